@@ -0,0 +1,229 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFFrameReader.h"
+#include "FFMCCropTrack.h"
+#include "FFMultiCrop.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace Fmc;
+
+/**
+ * A job manifest is a text file containing one directive per line. Blank lines and lines starting with '#' are
+ * ignored. Paths may be quoted and relative paths are resolved against the manifest's directory.
+ *  source  <sourceFile>               The input video (required).
+ *  output  <trackFile> <outputFile> [<option>=<value>...]
+ *                                     Adds an output using the crops from a crop track file (1 or more required).
+ *                                     Any of the encoder options below may be overridden for just this output,
+ *                                     the overrides are applied on top of the job options from the whole manifest.
+ *  codec   <h264|h265>                The output codec.
+ *  quality <0-255>                    The output quality.
+ *  preset  <ultrafast|...|placebo>    The encoder preset.
+ *  threads <count>                    The number of encoder threads (0 for auto).
+ *  gop     <size>                     The output GOP size (0 for default).
+ */
+struct Job
+{
+    string m_sourceFile;
+    vector<CropOptions> m_cropList;
+    EncoderOptions m_options;
+    vector<vector<pair<string, string>>> m_overrides; /**< Encoder option overrides for each output */
+};
+
+static string resolvePath(const string& path, const string& baseDir)
+{
+    if (path.empty() || baseDir.empty() || path[0] == '/' || path[0] == '\\' ||
+        (path.size() > 1 && path[1] == ':')) {
+        return path;
+    }
+    return baseDir + path;
+}
+
+static bool parsePreset(const string& name, EncoderOptions::Preset& preset)
+{
+    static const pair<const char*, EncoderOptions::Preset> presets[] = {
+        {"ultrafast", EncoderOptions::Preset::Ultrafast},
+        {"superfast", EncoderOptions::Preset::Superfast},
+        {"veryfast", EncoderOptions::Preset::Veryfast},
+        {"faster", EncoderOptions::Preset::Faster},
+        {"fast", EncoderOptions::Preset::Fast},
+        {"medium", EncoderOptions::Preset::Medium},
+        {"slow", EncoderOptions::Preset::Slow},
+        {"slower", EncoderOptions::Preset::Slower},
+        {"veryslow", EncoderOptions::Preset::Veryslow},
+        {"placebo", EncoderOptions::Preset::Placebo},
+    };
+    for (const auto& i : presets) {
+        if (name == i.first) {
+            preset = i.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseUnsigned(const string& text, const uint32_t maxValue, uint32_t& value)
+{
+    // Only plain digits are accepted, stream extraction would wrap a negative value and ignore trailing characters
+    if (text.empty() || text.size() > 10 || text.find_first_not_of("0123456789") != string::npos) {
+        return false;
+    }
+    const auto parsed = stoull(text);
+    if (parsed > maxValue) {
+        return false;
+    }
+    value = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+static bool parseEncoderOption(const string& name, istream& stream, EncoderOptions& options)
+{
+    // Each option takes exactly 1 value
+    string value;
+    string extra;
+    if (!(stream >> value) || stream >> extra) {
+        return false;
+    }
+    if (name == "codec") {
+        if (value == "h264") {
+            options.m_type = EncodeType::h264;
+        } else if (value == "h265") {
+            options.m_type = EncodeType::h265;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (name == "quality") {
+        uint32_t quality;
+        if (!parseUnsigned(value, 255, quality)) {
+            return false;
+        }
+        options.m_quality = static_cast<uint8_t>(quality);
+        return true;
+    }
+    if (name == "preset") {
+        return parsePreset(value, options.m_preset);
+    }
+    if (name == "threads") {
+        return parseUnsigned(value, UINT32_MAX, options.m_numThreads);
+    }
+    if (name == "gop") {
+        return parseUnsigned(value, UINT32_MAX, options.m_gopSize);
+    }
+    return false;
+}
+
+static bool parseManifest(const string& manifestFile, Job& job)
+{
+    ifstream file(manifestFile);
+    if (!file.is_open()) {
+        cerr << "Failed to open manifest: " << manifestFile << endl;
+        return false;
+    }
+    const auto pos = manifestFile.find_last_of("/\\");
+    const string baseDir = (pos != string::npos) ? manifestFile.substr(0, pos + 1) : string();
+
+    string line;
+    uint32_t lineNum = 0;
+    while (getline(file, line)) {
+        ++lineNum;
+        istringstream stream(line);
+        string directive;
+        if (!(stream >> directive) || directive[0] == '#') {
+            continue;
+        }
+        bool valid = true;
+        if (directive == "source") {
+            valid = static_cast<bool>(stream >> quoted(job.m_sourceFile));
+            job.m_sourceFile = resolvePath(job.m_sourceFile, baseDir);
+        } else if (directive == "output") {
+            string trackFile;
+            CropOptions options;
+            valid = static_cast<bool>(stream >> quoted(trackFile) >> quoted(options.m_fileName));
+            if (valid) {
+                if (!loadCropTrack(resolvePath(trackFile, baseDir), options)) {
+                    return false;
+                }
+                options.m_fileName = resolvePath(options.m_fileName, baseDir);
+
+                // Overrides are validated now but only applied once all job options are known
+                vector<pair<string, string>> overrides;
+                string override;
+                while (valid && stream >> override) {
+                    const auto split = override.find('=');
+                    EncoderOptions scratch;
+                    istringstream value(override.substr(split + 1));
+                    valid = split != string::npos && parseEncoderOption(override.substr(0, split), value, scratch);
+                    overrides.emplace_back(override.substr(0, split), override.substr(split + 1));
+                }
+                job.m_overrides.emplace_back(move(overrides));
+                job.m_cropList.emplace_back(move(options));
+            }
+        } else {
+            valid = parseEncoderOption(directive, stream, job.m_options);
+        }
+        if (!valid) {
+            cerr << manifestFile << ":" << lineNum << ": Invalid manifest entry: " << line << endl;
+            return false;
+        }
+    }
+    if (job.m_sourceFile.empty() || job.m_cropList.empty()) {
+        cerr << manifestFile << ": Manifest requires a source and at least 1 output" << endl;
+        return false;
+    }
+
+    // Apply per output overrides on top of the final job options
+    for (size_t i = 0; i < job.m_cropList.size(); ++i) {
+        if (job.m_overrides[i].empty()) {
+            continue;
+        }
+        auto& options = job.m_cropList[i];
+        options.m_overrideEncoderOptions = true;
+        options.m_encoderOptions = job.m_options;
+        for (const auto& j : job.m_overrides[i]) {
+            istringstream value(j.second);
+            parseEncoderOption(j.first, value, options.m_encoderOptions);
+        }
+    }
+    return true;
+}
+
+int main(const int argc, char** argv)
+{
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <manifest> [<manifest>...]" << endl;
+        return 1;
+    }
+    Ffr::setLogLevel(Ffr::LogLevel::Warning);
+
+    // Run each job in turn
+    int ret = 0;
+    for (int i = 1; i < argc; ++i) {
+        Job job;
+        if (!parseManifest(argv[i], job) || !cropAndEncode(job.m_sourceFile, job.m_cropList, job.m_options)) {
+            cerr << "Job failed: " << argv[i] << endl;
+            ret = 1;
+        }
+    }
+    return ret;
+}
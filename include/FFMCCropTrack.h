@@ -0,0 +1,119 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "FFMultiCrop.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Fmc {
+/**
+ * Header found at the start of a crop track file.
+ * A crop track file is laid out as:
+ *  - The header.
+ *  - m_numSkipRegions skip regions, each stored as 2 uint64_t values [startFrame, endFrame).
+ *  - m_numCrops crop positions, each stored as 2 uint32_t values (top, left).
+ * All values are stored little-endian so that the crop array can be used directly from a memory mapping.
+ */
+struct CropTrackHeader
+{
+    char m_magic[4];           /**< File identifier, must be "FMCT" */
+    uint32_t m_version;        /**< File format version */
+    uint32_t m_width;          /**< The width of the output video */
+    uint32_t m_height;         /**< The height of the output video */
+    uint64_t m_numSkipRegions; /**< Number of skip regions stored after the header */
+    uint64_t m_numCrops;       /**< Number of crop positions stored after the skip regions */
+};
+
+class CropTrack
+{
+public:
+    CropTrack() = delete;
+
+    FFMULTICROP_EXPORT ~CropTrack();
+
+    CropTrack(const CropTrack& other) = delete;
+
+    CropTrack(CropTrack&& other) noexcept = delete;
+
+    CropTrack& operator=(const CropTrack& other) = delete;
+
+    CropTrack& operator=(CropTrack&& other) noexcept = delete;
+
+    class ConstructorLock
+    {
+        friend class CropTrack;
+    };
+
+    FFMULTICROP_NO_EXPORT CropTrack(const uint8_t* data, uint64_t size, ConstructorLock) noexcept;
+
+    /**
+     * Opens a crop track file and maps it into memory.
+     * @param fileName Filename of the crop track file.
+     * @returns The crop track if succeeded, nullptr otherwise.
+     */
+    FFMULTICROP_EXPORT static std::shared_ptr<CropTrack> getCropTrack(const std::string& fileName) noexcept;
+
+    /**
+     * Gets the output resolution stored in the track.
+     * @returns The resolution.
+     */
+    FFMULTICROP_EXPORT Resolution getResolution() const noexcept;
+
+    /**
+     * Gets the skip regions stored in the track.
+     * @returns The list of skip regions.
+     */
+    FFMULTICROP_EXPORT std::vector<std::pair<uint64_t, uint64_t>> getSkipRegions() const noexcept;
+
+    /**
+     * Gets the number of crop positions stored in the track.
+     * @returns The number of crops.
+     */
+    FFMULTICROP_EXPORT uint64_t getNumCrops() const noexcept;
+
+    /**
+     * Gets the crop positions stored in the track. This points directly into the mapped file.
+     * @returns The crop array.
+     */
+    FFMULTICROP_EXPORT const CropPosition* getCrops() const noexcept;
+
+private:
+    const uint8_t* m_data = nullptr;
+    uint64_t m_size = 0;
+};
+
+/**
+ * Loads crop options from a crop track file. The crop list is used directly from the mapped file without copying.
+ * @note The output filename is not stored in the track and must be set separately.
+ * @param       trackFile Filename of the crop track file.
+ * @param [out] options   The loaded crop options.
+ * @returns True if it succeeds, false if it fails.
+ */
+FFMULTICROP_EXPORT bool loadCropTrack(const std::string& trackFile, CropOptions& options) noexcept;
+
+/**
+ * Saves crop options to a crop track file. The file is replaced once it has been completely written so the crop
+ * options may use a crop track loaded from the same file.
+ * @param trackFile Filename of the crop track file.
+ * @param options   The crop options to save.
+ * @returns True if it succeeds, false if it fails.
+ */
+FFMULTICROP_EXPORT bool saveCropTrack(const std::string& trackFile, const CropOptions& options) noexcept;
+} // namespace Fmc
@@ -18,7 +18,10 @@
 #include "FFFRStream.h"
 #include "FFMCExports.h"
 
+#include <chrono>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -35,6 +38,8 @@ struct CropPosition
     uint32_t m_left; /**< The offset in pixels from left of frame */
 };
 
+class CropTrack;
+
 class CropOptions
 {
 public:
@@ -57,11 +62,21 @@ public:
      */
     FFMULTICROP_EXPORT CropPosition getCrop(uint64_t frame) const noexcept;
 
+    /**
+     * Gets the number of crop values.
+     * @returns The number of crops, taken from the crop track if one is set.
+     */
+    FFMULTICROP_EXPORT uint64_t getNumCrops() const noexcept;
+
     std::vector<CropPosition> m_cropList; /**< List of crops for each frame in video */
     Resolution m_resolution = {0, 0};     /**< The resolution of the output video (affects crop size) */
     std::string m_fileName;               /**< Filename of the output file */
     std::vector<std::pair<uint64_t, uint64_t>> m_skipRegions; /**< A list of frame ranges to skip during encoding. The
                                                                list elements takes the form [startFrame, endFrame) */
+    std::shared_ptr<CropTrack> m_cropTrack; /**< (Optional) Memory-mapped crop track used in place of m_cropList */
+    bool m_overrideEncoderOptions = false;  /**< True to encode this output using m_encoderOptions */
+    EncoderOptions m_encoderOptions;        /**< Encoder options for this output, overrides the options passed to the
+                                                 encode function when m_overrideEncoderOptions is set */
 };
 
 /**
@@ -84,6 +99,16 @@ FFMULTICROP_EXPORT bool cropAndEncode(const std::string& sourceFile, const std::
 FFMULTICROP_EXPORT bool cropAndEncode(const std::shared_ptr<Stream>& stream, const std::vector<CropOptions>& cropList,
     const EncoderOptions& options = EncoderOptions()) noexcept;
 
+/**
+ * Enables or disables the on-disk source index cache.
+ * When enabled, a sidecar file (sourceFile + ".ffmcidx") holding the source frame count and key frame positions
+ * is created on the first complete decode of a source file and is used by later jobs on the same file to validate
+ * crop lists and to seek directly past skipped frames. The cache is disabled by default as it writes files into the
+ * source directory.
+ * @param enable True to enable, false to disable.
+ */
+FFMULTICROP_EXPORT void setSourceIndexCache(bool enable) noexcept;
+
 class MultiCrop;
 
 class MultiCropServer
@@ -91,6 +116,9 @@ class MultiCropServer
 public:
     MultiCropServer() = delete;
 
+    /**
+     * Destructor. Cancels the encode if it is still running and deletes its partial outputs.
+     */
     FFMULTICROP_EXPORT ~MultiCropServer();
 
     MultiCropServer(const MultiCropServer& other) = delete;
@@ -113,7 +141,16 @@ public:
     {
         Failed,
         Running,
-        Completed
+        Completed,
+        Cancelled
+    };
+
+    struct DecodeStatistics
+    {
+        int64_t m_joinFrame;    /**< The first frame received from the shared decode of the source */
+        int64_t m_ownFrames;    /**< Number of frames missed by the shared decode that were decoded separately */
+        int64_t m_lastOwnFrame; /**< The last frame that was decoded separately, -1 if none */
+        int64_t m_sharedFrames; /**< Number of frames received from the shared decode */
     };
 
     /**
@@ -128,9 +165,33 @@ public:
      */
     FFMULTICROP_EXPORT float getProgress() noexcept;
 
+    /**
+     * Gets statistics on how the source frames were decoded. Jobs on the same source share a single decode, a job
+     * that starts while another is running only decodes the frames that it missed separately.
+     * @returns The decode statistics.
+     */
+    FFMULTICROP_EXPORT DecodeStatistics getDecodeStatistics() noexcept;
+
+    /**
+     * Cancels the encode. The job stops at the next frame boundary and this call blocks until its encoders have been
+     * released. Has no effect if the encode has already finished. Other threads may poll the status and progress while
+     * this call is waiting.
+     * @param keepPartial (Optional) True to flush and finalise the partially encoded outputs, false to delete them.
+     */
+    FFMULTICROP_EXPORT void cancel(bool keepPartial = false) noexcept;
+
+    /**
+     * Sets a time limit for the encode. If the encode has not finished once the limit is reached then it is
+     * cancelled at the next frame boundary and the status becomes Cancelled.
+     * @param timeout     The time limit measured from when this function is called.
+     * @param keepPartial (Optional) True to flush and finalise the partially encoded outputs, false to delete them.
+     */
+    FFMULTICROP_EXPORT void setTimeout(std::chrono::milliseconds timeout, bool keepPartial = false) noexcept;
+
 private:
     std::shared_ptr<MultiCrop> m_multiCrop;
-    std::future<bool> m_future;
+    std::shared_future<bool> m_future; /**< Shared so that other threads can wait on it while the result is read */
+    std::mutex m_mutex;                /**< Guards m_status as the server may be polled and cancelled concurrently */
     Status m_status = Status::Running;
 };
 
@@ -13,8 +13,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include "FFMCCropTrack.h"
 #include "FFMultiCrop.h"
 
+#include <pybind11/chrono.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
@@ -40,6 +42,9 @@ void bindMultiCrop(pybind11::module& m)
         .def_readwrite("resolution", &CropOptions::m_resolution)
         .def_readwrite("fileName", &CropOptions::m_fileName)
         .def_readwrite("skipRegions", &CropOptions::m_skipRegions)
+        .def_readwrite("overrideEncoderOptions", &CropOptions::m_overrideEncoderOptions)
+        .def_readwrite("encoderOptions", &CropOptions::m_encoderOptions)
+        .def("getNumCrops", &CropOptions::getNumCrops, "Gets the number of crop values.")
         .def("assign", static_cast<CropOptions& (CropOptions::*)(const CropOptions&)>(&CropOptions::operator=), "",
             pybind11::return_value_policy::automatic, pybind11::arg("other"));
 
@@ -48,13 +53,45 @@ void bindMultiCrop(pybind11::module& m)
         pybind11::enum_<MultiCropServer::Status>(cl, "Status", "")
             .value("Failed", MultiCropServer::Status::Failed)
             .value("Running", MultiCropServer::Status::Running)
-            .value("Completed", MultiCropServer::Status::Completed);
+            .value("Completed", MultiCropServer::Status::Completed)
+            .value("Cancelled", MultiCropServer::Status::Cancelled);
+        pybind11::class_<MultiCropServer::DecodeStatistics>(cl, "DecodeStatistics", "")
+            .def_readonly("joinFrame", &MultiCropServer::DecodeStatistics::m_joinFrame)
+            .def_readonly("ownFrames", &MultiCropServer::DecodeStatistics::m_ownFrames)
+            .def_readonly("lastOwnFrame", &MultiCropServer::DecodeStatistics::m_lastOwnFrame)
+            .def_readonly("sharedFrames", &MultiCropServer::DecodeStatistics::m_sharedFrames);
         cl.def("getStatus", static_cast<MultiCropServer::Status (MultiCropServer::*)()>(&MultiCropServer::getStatus),
             "Gets the encode status.");
         cl.def("getProgress", static_cast<float (MultiCropServer::*)()>(&MultiCropServer::getProgress),
             "Gets the encode progress (normalised value between 0 and 1 inclusive).");
+        cl.def("getDecodeStatistics", &MultiCropServer::getDecodeStatistics,
+            "Gets statistics on how the source frames were decoded.");
+        cl.def("cancel", &MultiCropServer::cancel,
+            "Cancels the encode and waits for it to stop. Partial outputs are finalised if keepPartial is set, "
+            "otherwise they are deleted.",
+            pybind11::arg("keepPartial") = false, pybind11::call_guard<pybind11::gil_scoped_release>());
+        cl.def("setTimeout", &MultiCropServer::setTimeout,
+            "Sets a time limit (timedelta or seconds) after which the encode is cancelled.", pybind11::arg("timeout"),
+            pybind11::arg("keepPartial") = false);
     }
 
+    m.def("setSourceIndexCache", &setSourceIndexCache, "Enables or disables the on-disk source index cache.",
+        pybind11::arg("enable"));
+
+    m.def(
+        "loadCropTrack",
+        [](const std::string& trackFile) -> pybind11::object {
+            CropOptions options;
+            if (!loadCropTrack(trackFile, options)) {
+                return pybind11::none();
+            }
+            return pybind11::cast(options);
+        },
+        "Loads crop options from a crop track file (returns None on failure).", pybind11::arg("trackFile"));
+
+    m.def("saveCropTrack", &saveCropTrack, "Saves crop options to a crop track file.",
+        pybind11::return_value_policy::automatic, pybind11::arg("trackFile"), pybind11::arg("options"));
+
     m.def("cropAndEncode",
         static_cast<bool (*)(const std::string&, const std::vector<CropOptions>&, const EncoderOptions&)>(
             &cropAndEncode),
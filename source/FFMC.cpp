@@ -18,9 +18,20 @@
 #include "FFFRStreamUtils.h"
 #include "FFFRUtility.h"
 #include "FFFrameReader.h"
+#include "FFMCCrop.h"
+#include "FFMCCropTrack.h"
+#include "FFMCEncoderOptions.h"
+#include "FFMCSourceIndex.h"
 #include "FFMultiCrop.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <utility>
 
 extern "C" {
@@ -33,7 +44,11 @@ extern "C" {
 using namespace std;
 
 namespace Fmc {
-class MultiCrop
+static atomic<bool> s_sourceIndexCache(false); /**< True if source index sidecar files are used */
+
+static constexpr size_t s_maxQueuedFrames = 8; /**< Maximum decoded frames queued for each job */
+
+class MultiCrop : public enable_shared_from_this<MultiCrop>
 {
 public:
     shared_ptr<Stream> m_stream;
@@ -46,64 +61,190 @@ public:
             , m_cropList(move(cropOptions))
         {}
 
+        /**
+         * Gets the next frame required by this output.
+         * @param frame The frame to search from.
+         * @returns The first frame at or after the input frame that is not skipped, INT64_MAX if none.
+         */
+        int64_t getNextFrame(const int64_t frame) const noexcept
+        {
+            uint64_t next = static_cast<uint64_t>(frame);
+            uint64_t skipSize = 0;
+            for (const auto& i : m_cropList.m_skipRegions) {
+                if (next >= i.first && next < i.second) {
+                    next = i.second;
+                }
+                if (next >= i.second) {
+                    skipSize += i.second - i.first;
+                } else {
+                    break;
+                }
+            }
+            return (next - skipSize < m_cropList.getNumCrops()) ? static_cast<int64_t>(next) : INT64_MAX;
+        }
+
         shared_ptr<Ffr::Encoder> m_encoder = nullptr;
         CropOptions m_cropList;
         int64_t m_lastValidTime = INT64_MIN;
     };
 
+    struct PendingFrame
+    {
+        shared_ptr<Ffr::Frame> m_frame;
+        int64_t m_timeDelta;
+        shared_ptr<Stream> m_stream;
+    };
+
     vector<EncoderParams> m_encoders;
-    int64_t m_currentFrame = 0;
+    atomic<int64_t> m_currentFrame;
+    int64_t m_firstFrame;
     int64_t m_lastFrame;
+    string m_sourceFile;
+    FileIdentity m_sourceIdentity; /**< Identity of the source file when it was opened */
+    shared_ptr<SourceIndex> m_index;
+
+    // Cancellation state, set by the server and checked between frames
+    atomic<bool> m_cancelled;    /**< True if the job has been cancelled or its deadline has passed */
+    atomic<bool> m_keepPartial;  /**< True if partial outputs are finalised on cancel instead of deleted */
+    atomic<int64_t> m_deadline;  /**< Steady clock time (ns) after which the job is cancelled, INT64_MAX if none */
+    atomic<bool> m_wasCancelled; /**< True if the job finished because it was cancelled */
+
+    // Decode state of this job's own stream
+    int64_t m_lastTime = 0;
+    int64_t m_frameDelta = 0;
+    bool m_contiguous = false;
+    atomic<int64_t> m_ownFrames;     /**< Number of frames decoded using this job's own stream */
+    atomic<int64_t> m_lastOwnFrame;  /**< Last frame decoded using this job's own stream, -1 if none */
+    atomic<int64_t> m_sharedFrames;  /**< Number of frames received from the shared decode */
+
+    // Frame queue fed by the shared decode
+    atomic<int64_t> m_joinFrame;    /**< The first frame that the shared decode delivers to this job */
+    mutex m_mutex;
+    condition_variable m_condition; /**< Signalled whenever the queue or the job state changes */
+    deque<PendingFrame> m_queue;
+    bool m_decodeDone = false;      /**< True if the shared decode will deliver no more frames to this job */
+    bool m_decodeSuccess = false;   /**< True if the shared decode delivered all frames required by this job */
+    bool m_closed = false;          /**< True if the job no longer accepts frames */
+    bool m_catchingUp = false;      /**< True while the job decodes the frames before m_joinFrame itself */
 
     /**
      * Multi crop
-     * @param [in,out] stream    The input stream.
-     * @param [in,out] encoders  The configured output encoders and associated data.
-     * @param          lastFrame The last frame required by all output encoders.
+     * @param [in,out] stream     The input stream.
+     * @param [in,out] encoders   The configured output encoders and associated data.
+     * @param          firstFrame The first frame required by any output encoder.
+     * @param          lastFrame  The last frame required by all output encoders.
+     * @param          sourceFile (Optional) Filename of the input stream, used to update the source index.
+     * @param          identity   (Optional) Identity of the source file when it was opened.
+     * @param          index      (Optional) The cached index of the input stream.
      */
-    FFFRAMEREADER_NO_EXPORT MultiCrop(
-        shared_ptr<Stream> stream, vector<EncoderParams>& encoders, const int64_t lastFrame) noexcept
+    FFFRAMEREADER_NO_EXPORT MultiCrop(shared_ptr<Stream> stream, vector<EncoderParams>& encoders,
+        const int64_t firstFrame, const int64_t lastFrame, string sourceFile = string(),
+        const FileIdentity& identity = FileIdentity(), shared_ptr<SourceIndex> index = nullptr) noexcept
         : m_stream(move(stream))
         , m_encoders(move(encoders))
+        , m_currentFrame(0)
+        , m_firstFrame(firstFrame)
         , m_lastFrame(lastFrame)
+        , m_sourceFile(move(sourceFile))
+        , m_sourceIdentity(identity)
+        , m_index(move(index))
+        , m_cancelled(false)
+        , m_keepPartial(false)
+        , m_deadline(INT64_MAX)
+        , m_wasCancelled(false)
+        , m_ownFrames(0)
+        , m_lastOwnFrame(-1)
+        , m_sharedFrames(0)
+        , m_joinFrame(0)
     {}
 
     FFFRAMEREADER_NO_EXPORT static shared_ptr<MultiCrop> getMultiCrop(const string& sourceFile,
         const vector<CropOptions>& cropList, const EncoderOptions& options = EncoderOptions()) noexcept
     {
+        // Get the identity of the source before it is opened. Any index created by this job is saved with it so that a
+        // source that changes during the decode does not match the index
+        FileIdentity identity;
+        const bool hasIdentity = SourceIndex::getFileIdentity(sourceFile, identity);
+
+        // Check for a cached index of the source video
+        auto index = (s_sourceIndexCache && hasIdentity) ? SourceIndex::loadSourceIndex(sourceFile) : nullptr;
+        if (index != nullptr && index->m_complete) {
+            // Validate against the index before opening the source
+            for (auto& i : cropList) {
+                if (i.m_resolution.m_height > index->m_height || i.m_resolution.m_width > index->m_width) {
+                    Ffr::log("Required output resolution is greater than input stream"s, Ffr::LogLevel::Error);
+                    return nullptr;
+                }
+                if (i.getNumCrops() > static_cast<uint64_t>(index->m_indexedFrames)) {
+                    Ffr::log("Crop list contains more frames than are found in input stream"s, Ffr::LogLevel::Error);
+                    return nullptr;
+                }
+            }
+        }
+
         // Try and open source video
         const auto stream = Ffr::Stream::getStream(sourceFile);
         if (stream == nullptr) {
             return nullptr;
         }
+        if (index != nullptr && !isIndexValid(*index, *stream)) {
+            Ffr::log("Ignoring source index that does not match the source: "s += sourceFile, Ffr::LogLevel::Warning);
+            index = nullptr;
+        }
 
-        return getMultiCrop(stream, cropList, options);
+        return getMultiCrop(stream, cropList, options, hasIdentity ? sourceFile : string(), identity, index);
+    }
+
+    /**
+     * Cross-checks a cached source index against the opened source.
+     * @param index  The source index.
+     * @param stream The opened source stream.
+     * @returns True if the index is consistent with the source.
+     */
+    FFFRAMEREADER_NO_EXPORT static bool isIndexValid(const SourceIndex& index, Stream& stream) noexcept
+    {
+        if (index.m_width != stream.getWidth() || index.m_height != stream.getHeight()) {
+            return false;
+        }
+        // The stream frame count is estimated from the container duration so only needs to be close to the exact count
+        const int64_t totalFrames = stream.getTotalFrames();
+        const int64_t tolerance = std::max(totalFrames / 100, static_cast<int64_t>(2));
+        if (index.m_complete) {
+            return std::abs(index.m_indexedFrames - totalFrames) <= tolerance;
+        }
+        return index.m_indexedFrames <= totalFrames + tolerance;
     }
 
     FFFRAMEREADER_NO_EXPORT static std::shared_ptr<MultiCrop> getMultiCrop(const std::shared_ptr<Stream>& stream,
-        const std::vector<CropOptions>& cropList, const EncoderOptions& options = EncoderOptions()) noexcept
+        const std::vector<CropOptions>& cropList, const EncoderOptions& options = EncoderOptions(),
+        const string& sourceFile = string(), const FileIdentity& identity = FileIdentity(),
+        const shared_ptr<SourceIndex>& index = nullptr) noexcept
     {
         // Auto calculate ideal number of threads
-        auto numThreads = options.m_numThreads;
-        if (numThreads == 0) {
-            numThreads = std::max(static_cast<uint32_t>(std::thread::hardware_concurrency() / cropList.size()), 2U);
-        }
+        const auto numThreads = getNumThreads(cropList, options, std::thread::hardware_concurrency());
+
+        // Use the exact frame count from the index if available
+        const int64_t streamFrames =
+            (index != nullptr && index->m_complete) ? index->m_indexedFrames : stream->getTotalFrames();
 
         int64_t longestFrames = 0;
-        int64_t startFrame = 0;
+        int64_t startFrame = INT64_MAX;
         vector<EncoderParams> encoders;
-        for (auto& i : cropList) {
+        for (size_t k = 0; k < cropList.size(); ++k) {
+            const auto& i = cropList[k];
+            const auto& encoderOptions = getEncoderOptions(i, options);
             // Validate the input crop sequence
             if (i.m_resolution.m_height > stream->getHeight() || i.m_resolution.m_width > stream->getWidth()) {
                 Ffr::log("Required output resolution is greater than input stream"s, Ffr::LogLevel::Error);
                 return nullptr;
             }
-            if (i.m_cropList.size() > static_cast<size_t>(stream->getTotalFrames())) {
+            if (i.getNumCrops() > static_cast<uint64_t>(streamFrames)) {
                 Ffr::log("Crop list contains more frames than are found in input stream"s, Ffr::LogLevel::Error);
                 return nullptr;
             }
             // Validate the input skip sequence
             size_t skipFrames = 0;
+            int64_t firstFrame = 0;
             for (const auto& j : i.m_skipRegions) {
                 if (j.second < j.first) {
                     Ffr::log("Crop list contains invalid skip region ("s += to_string(j.first) += ", "s +=
@@ -111,8 +252,7 @@ public:
                         Ffr::LogLevel::Error);
                     return nullptr;
                 }
-                if (j.second > static_cast<uint64_t>(stream->getTotalFrames()) ||
-                    j.first > static_cast<uint64_t>(stream->getTotalFrames())) {
+                if (j.second > static_cast<uint64_t>(streamFrames) || j.first > static_cast<uint64_t>(streamFrames)) {
                     Ffr::log(
                         "Crop list contains skip regions greater than total video size. Region will be ignored ("s +=
                         to_string(j.first) += ", "s += to_string(j.second) += ")."s,
@@ -121,167 +261,696 @@ public:
                 // Calculate total number of frames that will be skipped
                 skipFrames += j.second - j.first;
                 // Check if skipping start frames
-                if (j.first <= 0) {
-                    startFrame = std::min(startFrame, static_cast<int64_t>(j.second));
+                if (j.first <= static_cast<uint64_t>(firstFrame)) {
+                    firstFrame = std::max(firstFrame, static_cast<int64_t>(j.second));
                 }
             }
+            startFrame = std::min(startFrame, firstFrame);
             // Check total number of cropped/skipped frames
-            int64_t totalFrames = skipFrames + i.m_cropList.size();
-            if (totalFrames > stream->getTotalFrames()) {
+            int64_t totalFrames = skipFrames + i.getNumCrops();
+            if (totalFrames > streamFrames) {
                 Ffr::log(
                     "Crop list size combined with skip regions is greater than input stream. Crops greater than file length will be ignored."s,
                     Ffr::LogLevel::Warning);
-                totalFrames = stream->getTotalFrames();
+                totalFrames = streamFrames;
             }
             longestFrames = std::max(longestFrames, totalFrames);
-            // Seek to start crop region
-            if (startFrame > stream->peekNextFrame()->getFrameNumber()) {
-                stream->seekFrame(startFrame);
-            }
             // Create the new encoder
             auto encoder = make_shared<Ffr::Encoder>(i.m_fileName, i.m_resolution.m_width, i.m_resolution.m_height,
                 Ffr::getRational(Ffr::StreamUtils::getSampleAspectRatio(stream.get())), stream->getPixelFormat(),
                 Ffr::getRational(Ffr::StreamUtils::getFrameRate(stream.get())),
-                stream->frameToTime(i.m_cropList.size()), options.m_type, options.m_quality, options.m_preset,
-                numThreads, options.m_gopSize, Ffr::Encoder::ConstructorLock());
+                stream->frameToTime(i.getNumCrops()), encoderOptions.m_type, encoderOptions.m_quality,
+                encoderOptions.m_preset, numThreads[k], encoderOptions.m_gopSize, Ffr::Encoder::ConstructorLock());
             if (!encoder->isEncoderValid()) {
                 return nullptr;
             }
             encoders.emplace_back(encoder, i);
         }
 
+        // Seek to start crop region. Without an index the seek is always attempted, with one it is only performed if
+        // it would actually skip a key frame
+        const auto currentFrame = stream->peekNextFrame()->getFrameNumber();
+        if (startFrame != INT64_MAX && startFrame > currentFrame && startFrame < streamFrames &&
+            (index == nullptr || index->hasKeyFrame(currentFrame, startFrame))) {
+            if (!stream->seekFrame(startFrame)) {
+                return nullptr;
+            }
+        }
+
         // Create object
-        return make_shared<MultiCrop>(stream, encoders, longestFrames);
+        return make_shared<MultiCrop>(
+            stream, encoders, (startFrame != INT64_MAX) ? startFrame : 0, longestFrames, sourceFile, identity, index);
+    }
+
+    /**
+     * Gets the next frame required by any output.
+     * @param frame The frame to search from.
+     * @returns The first frame at or after the input frame that is required, INT64_MAX if none.
+     */
+    FFFRAMEREADER_NO_EXPORT int64_t getNextFrame(const int64_t frame) const noexcept
+    {
+        int64_t nextFrame = INT64_MAX;
+        for (const auto& i : m_encoders) {
+            nextFrame = std::min(nextFrame, i.getNextFrame(frame));
+        }
+        return nextFrame;
+    }
+
+    /**
+     * Query if any output requires a frame.
+     * @param frame The frame index.
+     * @returns True if the frame is required.
+     */
+    FFFRAMEREADER_NO_EXPORT bool isFrameUsed(const int64_t frame) const noexcept
+    {
+        for (const auto& i : m_encoders) {
+            const auto crop = i.m_cropList.getCrop(static_cast<uint64_t>(frame));
+            if (crop.m_top != UINT32_MAX || crop.m_left != UINT32_MAX) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Crops and encodes a decoded frame to each output that requires it.
+     * @param       frame     The decoded frame.
+     * @param       timeDelta The time between the frame and the previously decoded frame.
+     * @param       stream    The stream the frame was decoded from.
+     * @param [out] used      Set to true if any output used the frame.
+     * @returns True if it succeeds, false if it fails.
+     */
+    FFFRAMEREADER_NO_EXPORT bool processFrame(const shared_ptr<Ffr::Frame>& frame, const int64_t timeDelta,
+        const shared_ptr<Stream>& stream, bool& used) noexcept
+    {
+        if (isCancelled()) {
+            return false;
+        }
+        m_currentFrame = frame->getFrameNumber() + 1;
+        // Send decoded frame to the encoder(s)
+        for (auto& i : m_encoders) {
+            const auto crop = i.m_cropList.getCrop(static_cast<uint64_t>(frame->getFrameNumber()));
+            if (crop.m_top != UINT32_MAX || crop.m_left != UINT32_MAX) {
+                // Duplicate frame
+                Ffr::FramePtr copyFrame(av_frame_clone(frame->m_frame.m_frame));
+                if (copyFrame.m_frame == nullptr) {
+                    Ffr::log("Failed to copy frame", Ffr::LogLevel::Error);
+                    return false;
+                }
+                auto newFrame = make_shared<Ffr::Frame>(copyFrame, frame->m_timeStamp, frame->m_frameNum,
+                    frame->m_formatContext, frame->m_codecContext);
+
+                // Apply crop settings. The crop may also be aligned for some formats which is not reported
+                const auto& resolution = i.m_cropList.m_resolution;
+                const bool clamped =
+                    crop.m_top > static_cast<uint32_t>(newFrame->m_frame->height) - resolution.m_height ||
+                    crop.m_left > static_cast<uint32_t>(newFrame->m_frame->width) - resolution.m_width;
+                auto cropPosition = crop;
+                if (!cropFrame(newFrame->m_frame.m_frame, cropPosition, resolution)) {
+                    return false;
+                }
+                if (clamped) {
+                    Ffr::log("Out of range crop values detected, crop has been clamped for frame: "s +
+                            to_string(newFrame->getFrameNumber()),
+                        Ffr::LogLevel::Warning);
+                }
+
+                // Correct timestamp in case of skip regions
+                const int64_t timeStamp = (i.m_lastValidTime != INT64_MIN) ? i.m_lastValidTime + timeDelta : 0;
+                newFrame->m_frame->best_effort_timestamp = timeStamp;
+                newFrame->m_frame->pts = timeStamp;
+
+                i.m_lastValidTime = timeStamp;
+
+                // Encode new frame
+                if (!i.m_encoder->encodeFrame(newFrame, stream)) {
+                    return false;
+                }
+                used = true;
+            }
+        }
+        return true;
     }
 
-    FFFRAMEREADER_NO_EXPORT bool encodeLoop() noexcept
+    /**
+     * Completes the job.
+     * @param success True if all frames were successfully encoded, in which case the outputs are flushed.
+     * @returns True if the job succeeded.
+     */
+    FFFRAMEREADER_NO_EXPORT bool finish(bool success) noexcept
+    {
+        if (success) {
+            // Send flush frame
+            for (auto& i : m_encoders) {
+                if (!i.m_encoder->encodeFrame(nullptr, nullptr)) {
+                    success = false;
+                    break;
+                }
+            }
+        } else if (m_cancelled) {
+            m_wasCancelled = true;
+            if (m_keepPartial) {
+                // Flush so that the outputs contain all frames encoded so far
+                for (auto& i : m_encoders) {
+                    i.m_encoder->encodeFrame(nullptr, nullptr);
+                }
+            } else {
+                // Close and delete the partial outputs
+                for (auto& i : m_encoders) {
+                    i.m_encoder = nullptr;
+                    remove(i.m_cropList.m_fileName.c_str());
+                }
+            }
+            Ffr::log("Encode cancelled at frame: "s += to_string(m_currentFrame), Ffr::LogLevel::Info);
+        }
+        m_stream = nullptr;
+        return success;
+    }
+
+    /**
+     * Decodes the frames that the shared decode passed before this job attached using the job's own stream. The join
+     * frame moves forward while the job is decoding if the shared decode has to drop queued frames, so this continues
+     * until the stream has caught up with the first frame still queued.
+     * @returns True if it succeeds, false if it fails.
+     */
+    FFFRAMEREADER_NO_EXPORT bool decodeMissedFrames() noexcept
+    {
+        while (true) {
+            if (isCancelled()) {
+                return false;
+            }
+            const auto nextFrame = m_stream->peekNextFrame();
+            if (nextFrame == nullptr) {
+                return m_stream->isEndOfFile();
+            }
+            if (nextFrame->getFrameNumber() >= m_lastFrame || hasCaughtUp(nextFrame->getFrameNumber())) {
+                return true;
+            }
+            const auto frame = m_stream->getNextFrame();
+            if (frame == nullptr) {
+                return false;
+            }
+            ++m_ownFrames;
+            m_lastOwnFrame = frame->getFrameNumber();
+            const int64_t timeDelta = m_contiguous ? frame->m_frame->best_effort_timestamp - m_lastTime : m_frameDelta;
+            if (m_contiguous) {
+                m_frameDelta = timeDelta;
+            }
+            m_lastTime = frame->m_frame->best_effort_timestamp;
+            m_contiguous = true;
+            bool used = false;
+            if (!processFrame(frame, timeDelta, m_stream, used)) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Checks if the job's own stream has reached the frames queued by the shared decode, once it has the join frame
+     * no longer moves.
+     * @param frame The next frame of the job's own stream.
+     * @returns True if the job has caught up.
+     */
+    FFFRAMEREADER_NO_EXPORT bool hasCaughtUp(const int64_t frame) noexcept
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (frame < m_joinFrame) {
+            return false;
+        }
+        m_catchingUp = false;
+        return true;
+    }
+
+    /**
+     * Queues a frame from the shared decode for this job, waiting while the queue is full. A job that is still
+     * decoding its missed frames never holds back the shared decode, instead the oldest queued frame is dropped and
+     * the job decodes it itself.
+     * @param frame The frame and associated data.
+     * @returns True if it succeeds, false if the job no longer accepts frames.
+     */
+    FFFRAMEREADER_NO_EXPORT bool pushFrame(PendingFrame frame) noexcept
+    {
+        unique_lock<mutex> lock(m_mutex);
+        if (m_catchingUp) {
+            if (m_queue.size() >= s_maxQueuedFrames) {
+                m_joinFrame = m_queue.front().m_frame->getFrameNumber() + 1;
+                m_queue.pop_front();
+            }
+        } else {
+            m_condition.wait(lock, [this] { return m_closed || m_queue.size() < s_maxQueuedFrames; });
+        }
+        if (m_closed) {
+            return false;
+        }
+        m_queue.push_back(move(frame));
+        m_condition.notify_all();
+        return true;
+    }
+
+    /**
+     * Called once the shared decode will no longer deliver frames to this job.
+     * @param success True if the shared decode delivered all required frames.
+     */
+    FFFRAMEREADER_NO_EXPORT void endFrames(const bool success) noexcept
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_decodeDone = true;
+            m_decodeSuccess = success;
+        }
+        m_condition.notify_all();
+    }
+
+    /**
+     * Gets the next frame queued by the shared decode, waiting until one is available.
+     * @param [out] frame   The frame and associated data.
+     * @param [out] success Set to true if the shared decode delivered all required frames, only valid when no frame
+     *  is returned.
+     * @returns True if a frame was returned, false if there are no more frames or the job was cancelled.
+     */
+    FFFRAMEREADER_NO_EXPORT bool popFrame(PendingFrame& frame, bool& success) noexcept
+    {
+        unique_lock<mutex> lock(m_mutex);
+        while (m_queue.empty() && !m_decodeDone) {
+            if (isCancelled()) {
+                success = false;
+                return false;
+            }
+            const int64_t deadline = m_deadline;
+            if (deadline != INT64_MAX) {
+                m_condition.wait_until(lock,
+                    chrono::steady_clock::time_point(
+                        chrono::duration_cast<chrono::steady_clock::duration>(chrono::nanoseconds(deadline))));
+            } else {
+                m_condition.wait(lock);
+            }
+        }
+        if (m_queue.empty()) {
+            success = m_decodeSuccess;
+            return false;
+        }
+        frame = move(m_queue.front());
+        m_queue.pop_front();
+        m_condition.notify_all();
+        return true;
+    }
+
+    /**
+     * Stops the job accepting frames, any queued frames are discarded and a waiting shared decode is released.
+     */
+    FFFRAMEREADER_NO_EXPORT void close() noexcept
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_closed = true;
+            m_queue.clear();
+        }
+        m_condition.notify_all();
+    }
+
+    FFFRAMEREADER_NO_EXPORT bool isClosed() noexcept
+    {
+        lock_guard<mutex> lock(m_mutex);
+        return m_closed;
+    }
+
+    /**
+     * Cancels the job at the next frame boundary.
+     * @param keepPartial True to finalise the partial outputs, false to delete them.
+     */
+    FFFRAMEREADER_NO_EXPORT void cancel(const bool keepPartial) noexcept
     {
-        // Loop through each frame and apply crop values
+        m_keepPartial = keepPartial;
+        {
+            // Set under the lock so that a job waiting for frames always sees the change
+            lock_guard<mutex> lock(m_mutex);
+            m_cancelled = true;
+        }
+        m_condition.notify_all();
+    }
+
+    /**
+     * Sets the time after which the job is cancelled.
+     * @param deadline    The deadline.
+     * @param keepPartial True to finalise the partial outputs, false to delete them.
+     */
+    FFFRAMEREADER_NO_EXPORT void setDeadline(
+        const chrono::steady_clock::time_point deadline, const bool keepPartial) noexcept
+    {
+        m_keepPartial = keepPartial;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_deadline = chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch()).count();
+        }
+        m_condition.notify_all();
+    }
+
+    /**
+     * Query if the job has been cancelled, a job is also cancelled once its deadline has passed.
+     * @returns True if cancelled.
+     */
+    FFFRAMEREADER_NO_EXPORT bool isCancelled() noexcept
+    {
+        if (m_cancelled) {
+            return true;
+        }
+        const int64_t deadline = m_deadline;
+        if (deadline != INT64_MAX &&
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count() >=
+                deadline) {
+            Ffr::log("Encode deadline exceeded"s, Ffr::LogLevel::Info);
+            m_cancelled = true;
+            return true;
+        }
+        return false;
+    }
+
+    FFFRAMEREADER_NO_EXPORT bool wasCancelled() const noexcept
+    {
+        return m_wasCancelled;
+    }
+
+    /**
+     * Runs the job on the calling thread. Any frames that the shared decode had passed before this job attached are
+     * decoded using the job's own stream, all remaining frames are received from the shared decode.
+     * @returns True if it succeeds, false if it fails.
+     */
+    FFFRAMEREADER_NO_EXPORT bool run() noexcept
+    {
+        bool success = true;
+        if (m_stream != nullptr) {
+            // Decode the missed frames and then release the stream as it is no longer needed
+            success = decodeMissedFrames();
+            m_stream = nullptr;
+            lock_guard<mutex> lock(m_mutex);
+            m_catchingUp = false;
+        }
+        if (success) {
+            PendingFrame pending;
+            while (popFrame(pending, success)) {
+                ++m_sharedFrames;
+                bool used = false;
+                if (!processFrame(pending.m_frame, pending.m_timeDelta, pending.m_stream, used)) {
+                    success = false;
+                    break;
+                }
+            }
+        }
+        close();
+        return finish(success);
+    }
+
+    FFFRAMEREADER_NO_EXPORT bool encodeLoop() noexcept;
+
+    FFFRAMEREADER_NO_EXPORT MultiCropServer::DecodeStatistics getDecodeStatistics() const noexcept
+    {
+        return {m_joinFrame, m_ownFrames, m_lastOwnFrame, m_sharedFrames};
+    }
+
+    FFFRAMEREADER_NO_EXPORT float getProgress() const
+    {
+        return static_cast<float>(m_currentFrame) / static_cast<float>(m_lastFrame);
+    }
+};
+
+/**
+ * Decodes a source stream and queues the decoded frames for each attached job, each job encodes on its own thread.
+ * Jobs can attach while the decode is running, in which case the job decodes any frames it missed using its own
+ * stream while the shared decode queues the frames from its current position onward. The decode waits for any job
+ * whose queue is full so that the memory used for queued frames is bounded, except for jobs that are still decoding
+ * their missed frames which instead decode any frames that do not fit in their queue themselves.
+ */
+class SharedDecode
+{
+public:
+    shared_ptr<Stream> m_stream;
+    string m_sourceFile;
+    FileIdentity m_sourceIdentity;
+    shared_ptr<SourceIndex> m_index;
+    SourceIndex m_newIndex;
+    bool m_indexing = true;
+
+    mutex m_mutex;
+    vector<shared_ptr<MultiCrop>> m_jobs;
+    bool m_accepting = true;
+    int64_t m_nextFrame = 0;
+
+    /**
+     * Shared decode
+     * @param stream     The input stream.
+     * @param sourceFile (Optional) Filename of the input stream, used to update the source index.
+     * @param identity   Identity of the source file when it was opened, saved with the updated source index.
+     * @param index      (Optional) The cached index of the input stream.
+     */
+    FFFRAMEREADER_NO_EXPORT SharedDecode(shared_ptr<Stream> stream, string sourceFile, const FileIdentity& identity,
+        shared_ptr<SourceIndex> index) noexcept
+        : m_stream(move(stream))
+        , m_sourceFile(move(sourceFile))
+        , m_sourceIdentity(identity)
+        , m_index(move(index))
+    {
+        m_newIndex.m_width = m_stream->getWidth();
+        m_newIndex.m_height = m_stream->getHeight();
+        const auto nextFrame = m_stream->peekNextFrame();
+        m_nextFrame = (nextFrame != nullptr) ? nextFrame->getFrameNumber() : 0;
+    }
+
+    /**
+     * Attach a job to the decode.
+     * @param job The job.
+     * @returns True if it succeeds, false if the decode has finished or has already passed all required frames.
+     */
+    FFFRAMEREADER_NO_EXPORT bool attach(const shared_ptr<MultiCrop>& job) noexcept
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (!m_accepting || m_nextFrame >= job->m_lastFrame) {
+            return false;
+        }
+        // The job is not yet running so its state can be set directly
+        job->m_joinFrame = m_nextFrame;
+        if (m_nextFrame <= job->m_firstFrame) {
+            // Own stream is only needed to decode missed frames
+            job->m_stream = nullptr;
+        }
+        job->m_catchingUp = job->m_stream != nullptr;
+        m_jobs.push_back(job);
+        return true;
+    }
+
+    FFFRAMEREADER_NO_EXPORT bool decodeLoop() noexcept
+    {
+        // Loop through each frame and pass to each job
         int64_t lastTime = 0;
-        uint32_t sentFrames = 0;
+        int64_t frameDelta = 0;
+        bool contiguous = false;
         while (true) {
-            // Check if already received all required frames
-            if (m_currentFrame >= m_lastFrame) {
-                // Send flush frame
-                for (auto& i : m_encoders) {
-                    if (!i.m_encoder->encodeFrame(nullptr, nullptr)) {
-                        return false;
+            // Release any jobs that have received all required frames or have stopped
+            vector<shared_ptr<MultiCrop>> jobs;
+            bool done;
+            {
+                lock_guard<mutex> lock(m_mutex);
+                for (auto i = m_jobs.begin(); i != m_jobs.end();) {
+                    if ((*i)->m_lastFrame <= m_nextFrame || (*i)->isClosed()) {
+                        jobs.push_back(*i);
+                        i = m_jobs.erase(i);
+                    } else {
+                        ++i;
                     }
                 }
+                done = m_jobs.empty();
+                m_accepting = !done;
+            }
+            for (auto& i : jobs) {
+                i->endFrames(true);
+            }
+            if (done) {
+                // Peek at the next frame to check if the index covers the entire source
+                updateIndex(m_indexing && m_stream->peekNextFrame() == nullptr && m_stream->isEndOfFile());
+                m_stream = nullptr;
                 return true;
             }
+
             // Get next frame
             auto frame = m_stream->getNextFrame();
+            jobs.clear();
+            {
+                lock_guard<mutex> lock(m_mutex);
+                if (frame == nullptr) {
+                    m_accepting = false;
+                    jobs.swap(m_jobs);
+                } else {
+                    m_nextFrame = frame->getFrameNumber() + 1;
+                    jobs = m_jobs;
+                }
+            }
             if (frame == nullptr) {
-                if (!m_stream->isEndOfFile()) {
-                    return false;
+                const bool endOfFile = m_stream->isEndOfFile();
+                for (auto& i : jobs) {
+                    i->endFrames(endOfFile);
                 }
-                // Send flush frame
-                for (auto& i : m_encoders) {
-                    if (!i.m_encoder->encodeFrame(nullptr, nullptr)) {
-                        return false;
+                updateIndex(endOfFile);
+                m_stream = nullptr;
+                return endOfFile;
+            }
+            // Record key frames while the decode is contiguous from the start of the source
+            if (m_indexing) {
+                if (frame->getFrameNumber() != m_newIndex.m_indexedFrames) {
+                    m_indexing = false;
+                } else {
+                    if (frame->m_frame->key_frame) {
+                        m_newIndex.m_keyFrames.push_back(frame->getFrameNumber());
                     }
+                    ++m_newIndex.m_indexedFrames;
                 }
-                return true;
             }
-            ++m_currentFrame;
-            // Send decoded frame to the encoder(s)
-            for (auto& i : m_encoders) {
-                const auto crop = i.m_cropList.getCrop(static_cast<uint64_t>(frame->getFrameNumber()));
-                if (crop.m_top != UINT32_MAX || crop.m_left != UINT32_MAX) {
-                    // Duplicate frame
-                    Ffr::FramePtr copyFrame(av_frame_clone(frame->m_frame.m_frame));
-                    if (copyFrame.m_frame == nullptr) {
-                        Ffr::log("Failed to copy frame", Ffr::LogLevel::Error);
-                        return false;
-                    }
-                    auto newFrame = make_shared<Ffr::Frame>(copyFrame, frame->m_timeStamp, frame->m_frameNum,
-                        frame->m_formatContext, frame->m_codecContext);
-
-                    // Correct out of range crop values
-                    auto cropTop = std::min(crop.m_top, m_stream->getHeight() - i.m_cropList.m_resolution.m_height);
-                    auto cropLeft = std::min(crop.m_left, m_stream->getWidth() - i.m_cropList.m_resolution.m_width);
-                    auto cropBottom = i.m_cropList.m_resolution.m_height + cropTop;
-                    if (cropBottom > m_stream->getHeight()) {
-                        cropTop -= cropBottom - m_stream->getHeight();
-                        cropBottom = 0;
-                    } else {
-                        cropBottom = m_stream->getHeight() - cropBottom;
+            // Time between this frame and the previous one, after a seek the previous valid delta is used instead
+            const int64_t timeDelta = contiguous ? frame->m_frame->best_effort_timestamp - lastTime : frameDelta;
+            // Queue decoded frame for each job that requires it. A job that has stopped is released on the next loop
+            bool used = false;
+            for (auto& i : jobs) {
+                if (frame->getFrameNumber() >= i->m_joinFrame && i->isFrameUsed(frame->getFrameNumber())) {
+                    used = true;
+                    i->pushFrame({frame, timeDelta, m_stream});
+                }
+            }
+            // Backup timestamp of last frame
+            if (contiguous) {
+                frameDelta = timeDelta;
+            }
+            lastTime = frame->m_frame->best_effort_timestamp;
+            contiguous = true;
+
+            // Seek past frames that are skipped by all jobs if the index shows that a key frame would be skipped.
+            // Jobs only receive frames after they attached so any frames skipped here are never required
+            if (!used && m_index != nullptr && frameDelta > 0) {
+                bool failed = false;
+                {
+                    lock_guard<mutex> lock(m_mutex);
+                    int64_t nextFrame = INT64_MAX;
+                    int64_t lastFrame = 0;
+                    for (const auto& i : m_jobs) {
+                        nextFrame = std::min(nextFrame, i->getNextFrame(m_nextFrame));
+                        lastFrame = std::max(lastFrame, i->m_lastFrame);
                     }
-                    auto cropRight = i.m_cropList.m_resolution.m_width + cropLeft;
-                    if (cropRight > m_stream->getWidth()) {
-                        cropLeft -= cropRight - m_stream->getWidth();
-                        cropRight = 0;
-                    } else {
-                        cropRight = m_stream->getWidth() - cropRight;
+                    if (nextFrame != INT64_MAX && nextFrame < lastFrame &&
+                        m_index->hasKeyFrame(m_nextFrame, nextFrame)) {
+                        if (m_stream->seekFrame(nextFrame)) {
+                            m_nextFrame = nextFrame;
+                            contiguous = false;
+                        } else {
+                            failed = true;
+                            m_accepting = false;
+                            jobs = move(m_jobs);
+                            m_jobs.clear();
+                        }
                     }
-                    if (cropTop != crop.m_top || cropLeft != crop.m_left) {
-                        Ffr::log("Out of range crop values detected, crop has been clamped for frame: "s +
-                                to_string(newFrame->getFrameNumber()),
-                            Ffr::LogLevel::Warning);
+                }
+                if (failed) {
+                    for (auto& i : jobs) {
+                        i->endFrames(false);
                     }
+                    m_stream = nullptr;
+                    return false;
+                }
+            }
+        }
+    }
 
-                    // Apply crop settings
-                    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(newFrame->m_codecContext->pix_fmt);
-                    if (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) {
-                        newFrame->m_frame->crop_top += cropTop;
-                        newFrame->m_frame->crop_bottom = cropBottom - newFrame->m_frame->crop_bottom;
-                        newFrame->m_frame->crop_left += cropLeft;
-                        newFrame->m_frame->crop_right = cropRight - newFrame->m_frame->crop_right;
-                    } else {
-                        int32_t maxStep[4];
-                        av_image_fill_max_pixsteps(maxStep, nullptr, desc);
-
-                        newFrame->m_frame->width = i.m_cropList.m_resolution.m_width;
-                        newFrame->m_frame->height = i.m_cropList.m_resolution.m_height;
-
-                        newFrame->m_frame->data[0] += cropTop * newFrame->m_frame->linesize[0];
-                        newFrame->m_frame->data[0] += cropLeft * maxStep[0];
-
-                        if (!(desc->flags & AV_PIX_FMT_FLAG_PAL || desc->flags & AV_PIX_FMT_FLAG_PSEUDOPAL)) {
-                            for (uint32_t j = 1; j < 3; j++) {
-                                if (newFrame->m_frame->data[j]) {
-                                    newFrame->m_frame->data[j] +=
-                                        (cropTop >> desc->log2_chroma_h) * newFrame->m_frame->linesize[j];
-                                    newFrame->m_frame->data[j] += (cropLeft * maxStep[j]) >> desc->log2_chroma_w;
-                                }
-                            }
-                        }
+    /**
+     * Updates the cached source index if the current decode has indexed more of the source than it already has.
+     * @param endOfFile True if the decode reached the end of the source.
+     */
+    FFFRAMEREADER_NO_EXPORT void updateIndex(const bool endOfFile) noexcept
+    {
+        if (m_sourceFile.empty() || !m_indexing || m_newIndex.m_indexedFrames == 0 || !s_sourceIndexCache) {
+            return;
+        }
+        m_newIndex.m_complete = endOfFile;
+        if (m_index != nullptr &&
+            (m_index->m_complete ||
+                (!m_newIndex.m_complete && m_index->m_indexedFrames >= m_newIndex.m_indexedFrames))) {
+            return;
+        }
+        m_newIndex.saveSourceIndex(m_sourceFile, m_sourceIdentity);
+    }
+};
 
-                        // Alpha plane must be treated separately
-                        if (newFrame->m_frame->data[3]) {
-                            newFrame->m_frame->data[3] += cropTop * newFrame->m_frame->linesize[3];
-                            newFrame->m_frame->data[3] += cropLeft * maxStep[3];
-                        }
-                    }
+bool MultiCrop::encodeLoop() noexcept
+{
+    // Decode on a separate thread using a shared decode that only this job is attached to
+    const auto decode = make_shared<SharedDecode>(m_stream, m_sourceFile, m_sourceIdentity, m_index);
+    if (!decode->attach(shared_from_this())) {
+        // No frames are required
+        endFrames(true);
+        return run();
+    }
+    auto decodeFuture(async(launch::async, &SharedDecode::decodeLoop, decode));
+    const bool ret = run();
+    decodeFuture.wait();
+    return ret;
+}
 
-                    // Correct timestamp in case of skip regions
-                    const int64_t timeStamp = (i.m_lastValidTime != INT64_MIN) ?
-                        i.m_lastValidTime + (frame->m_frame->best_effort_timestamp - lastTime) :
-                        0;
-                    newFrame->m_frame->best_effort_timestamp = timeStamp;
-                    newFrame->m_frame->pts = timeStamp;
+/**
+ * Registry of running shared decodes that new jobs on the same source can attach to.
+ */
+class SharedDecodeRegistry
+{
+public:
+    FFFRAMEREADER_NO_EXPORT static SharedDecodeRegistry& getInstance() noexcept
+    {
+        static SharedDecodeRegistry s_registry;
+        return s_registry;
+    }
 
-                    i.m_lastValidTime = timeStamp;
+    /**
+     * Attaches a job to a running decode of the source, a new decode is started if none can be attached to.
+     * @param sourceFile Source video.
+     * @param job        The job.
+     */
+    FFFRAMEREADER_NO_EXPORT void attach(const string& sourceFile, const shared_ptr<MultiCrop>& job) noexcept
+    {
+        lock_guard<mutex> lock(m_mutex);
+        // Clean up any completed decodes
+        m_decodes.erase(remove_if(m_decodes.begin(), m_decodes.end(),
+                            [](const Entry& i) {
+                                return i.m_future.wait_for(chrono::seconds(0)) == future_status::ready;
+                            }),
+            m_decodes.end());
 
-                    // Encode new frame
-                    if (!i.m_encoder->encodeFrame(newFrame, m_stream)) {
-                        return false;
-                    }
-                    ++sentFrames;
-                }
+        for (auto& i : m_decodes) {
+            if (i.m_sourceFile == sourceFile && i.m_decode->attach(job)) {
+                return;
             }
-            // Backup timestamp of last frame per output
-            lastTime = frame->m_frame->best_effort_timestamp;
         }
+
+        // Start a new decode using the job's stream
+        auto decode = make_shared<SharedDecode>(job->m_stream, job->m_sourceFile, job->m_sourceIdentity, job->m_index);
+        if (!decode->attach(job)) {
+            // No frames are required
+            job->endFrames(true);
+            return;
+        }
+        auto future(async(launch::async, &SharedDecode::decodeLoop, decode));
+        m_decodes.push_back({sourceFile, decode, move(future)});
     }
 
-    FFFRAMEREADER_NO_EXPORT float getProgress() const
+private:
+    struct Entry
     {
-        return static_cast<float>(m_currentFrame) / static_cast<float>(m_lastFrame);
-    }
+        string m_sourceFile;
+        shared_ptr<SharedDecode> m_decode;
+        future<bool> m_future;
+    };
+
+    mutex m_mutex;
+    vector<Entry> m_decodes;
 };
 
+void setSourceIndexCache(const bool enable) noexcept
+{
+    s_sourceIndexCache = enable;
+}
+
 CropPosition CropOptions::getCrop(const uint64_t frame) const noexcept
 {
     // Check if frame is in skip region
@@ -298,12 +967,23 @@ CropPosition CropOptions::getCrop(const uint64_t frame) const noexcept
             break;
         }
     }
-    if (!skip) {
+    if (!skip && frame - skipSize < getNumCrops()) {
+        if (m_cropTrack != nullptr) {
+            return m_cropTrack->getCrops()[frame - skipSize];
+        }
         return m_cropList[frame - skipSize];
     }
     return {UINT32_MAX, UINT32_MAX};
 }
 
+uint64_t CropOptions::getNumCrops() const noexcept
+{
+    if (m_cropTrack != nullptr) {
+        return m_cropTrack->getNumCrops();
+    }
+    return m_cropList.size();
+}
+
 bool cropAndEncode(
     const string& sourceFile, const vector<CropOptions>& cropList, const EncoderOptions& options) noexcept
 {
@@ -330,6 +1010,8 @@ bool cropAndEncode(
 
 MultiCropServer::~MultiCropServer()
 {
+    // Stop a running job instead of waiting for it to finish, nothing can query its result after this
+    cancel(false);
     if (m_future.valid()) {
         m_future.wait();
     }
@@ -342,10 +1024,15 @@ MultiCropServer::MultiCropServer(shared_ptr<MultiCrop>& multiCrop, future<bool>&
 
 MultiCropServer::Status MultiCropServer::getStatus() noexcept
 {
+    lock_guard<mutex> lock(m_mutex);
     if (m_status == Status::Running) {
         // Check for updates status
         if (m_future.wait_for(chrono::seconds(0)) == future_status::ready) {
-            m_status = m_future.get() ? Status::Completed : Status::Failed;
+            if (m_future.get()) {
+                m_status = Status::Completed;
+            } else {
+                m_status = m_multiCrop->wasCancelled() ? Status::Cancelled : Status::Failed;
+            }
         }
     }
     return m_status;
@@ -362,6 +1049,26 @@ float MultiCropServer::getProgress() noexcept
     return m_multiCrop->getProgress();
 }
 
+MultiCropServer::DecodeStatistics MultiCropServer::getDecodeStatistics() noexcept
+{
+    return m_multiCrop->getDecodeStatistics();
+}
+
+void MultiCropServer::cancel(const bool keepPartial) noexcept
+{
+    if (getStatus() != Status::Running) {
+        return;
+    }
+    m_multiCrop->cancel(keepPartial);
+    // Wait for the job to stop so that its encoders have been released on return. The result is left for getStatus
+    m_future.wait();
+}
+
+void MultiCropServer::setTimeout(const chrono::milliseconds timeout, const bool keepPartial) noexcept
+{
+    m_multiCrop->setDeadline(chrono::steady_clock::now() + timeout, keepPartial);
+}
+
 shared_ptr<MultiCropServer> cropAndEncodeAsync(
     const string& sourceFile, const vector<CropOptions>& cropList, const EncoderOptions& options) noexcept
 {
@@ -369,8 +1076,12 @@ shared_ptr<MultiCropServer> cropAndEncodeAsync(
     if (multiCrop == nullptr) {
         return nullptr;
     }
-    auto future(async(launch::async, &MultiCrop::encodeLoop, multiCrop));
+    // Share the decode with any other jobs running on the same source
+    SharedDecodeRegistry::getInstance().attach(sourceFile, multiCrop);
+    auto future(async(launch::async, &MultiCrop::run, multiCrop));
     if (!future.valid()) {
+        // Release the shared decode if it is waiting on the job
+        multiCrop->close();
         return nullptr;
     }
     return make_shared<MultiCropServer>(multiCrop, future, MultiCropServer::ConstructorLock());
@@ -0,0 +1,86 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFMCCrop.h"
+
+#include "FFFrameReader.h"
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+}
+
+using namespace std;
+
+namespace Fmc {
+bool cropFrame(AVFrame* frame, CropPosition& crop, const Resolution& resolution) noexcept
+{
+    const auto width = static_cast<uint32_t>(frame->width);
+    const auto height = static_cast<uint32_t>(frame->height);
+    if (resolution.m_width > width || resolution.m_height > height) {
+        Ffr::log("Required output resolution is greater than input frame"s, Ffr::LogLevel::Error);
+        return false;
+    }
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    if (desc == nullptr || desc->flags & AV_PIX_FMT_FLAG_BITSTREAM) {
+        Ffr::log("Cropping is not supported for the input pixel format"s, Ffr::LogLevel::Error);
+        return false;
+    }
+
+    // Correct out of range crop values
+    crop.m_top = std::min(crop.m_top, height - resolution.m_height);
+    crop.m_left = std::min(crop.m_left, width - resolution.m_width);
+    if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->log2_chroma_w) {
+        // Packed formats with subsampled chroma can only be cropped on chroma sample boundaries
+        crop.m_left &= ~((1U << desc->log2_chroma_w) - 1);
+    }
+
+    if (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+        const auto cropBottom = height - resolution.m_height - crop.m_top;
+        const auto cropRight = width - resolution.m_width - crop.m_left;
+        frame->crop_top += crop.m_top;
+        frame->crop_bottom = cropBottom - frame->crop_bottom;
+        frame->crop_left += crop.m_left;
+        frame->crop_right = cropRight - frame->crop_right;
+        return true;
+    }
+
+    // Get the per pixel step of each plane. This is the smallest step of any component in the plane so that packed
+    // formats step by a single pixel. Planes without components (i.e. palettes) are left unmodified
+    int32_t planeStep[4] = {0, 0, 0, 0};
+    for (uint32_t i = 0; i < desc->nb_components; i++) {
+        const auto& comp = desc->comp[i];
+        if (planeStep[comp.plane] == 0 || comp.step < planeStep[comp.plane]) {
+            planeStep[comp.plane] = comp.step;
+        }
+    }
+
+    frame->width = resolution.m_width;
+    frame->height = resolution.m_height;
+    for (uint32_t i = 0; i < 4; i++) {
+        if (frame->data[i] == nullptr || planeStep[i] == 0) {
+            continue;
+        }
+        // Only the chroma planes are subsampled, the alpha plane is always full size
+        const uint32_t shiftX = (i == 1 || i == 2) ? desc->log2_chroma_w : 0;
+        const uint32_t shiftY = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        frame->data[i] += static_cast<ptrdiff_t>(crop.m_top >> shiftY) * frame->linesize[i];
+        frame->data[i] += static_cast<ptrdiff_t>(crop.m_left >> shiftX) * planeStep[i];
+    }
+    return true;
+}
+} // namespace Fmc
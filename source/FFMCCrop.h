@@ -0,0 +1,33 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "FFMultiCrop.h"
+
+struct AVFrame;
+
+namespace Fmc {
+/**
+ * Crops a decoded frame in place. The frame data pointers are offset so that no pixel data is copied.
+ * Out of range crop values are clamped to the frame bounds, packed formats with subsampled chroma are additionally
+ * aligned to a chroma sample boundary.
+ * @param [in,out] frame      The frame to crop.
+ * @param [in,out] crop       The crop position, updated with the position that was applied if it had to be clamped.
+ * @param          resolution The resolution of the cropped frame.
+ * @returns True if it succeeds, false if it fails.
+ */
+FFMULTICROP_NO_EXPORT bool cropFrame(AVFrame* frame, CropPosition& crop, const Resolution& resolution) noexcept;
+} // namespace Fmc
@@ -0,0 +1,237 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFMCCropTrack.h"
+
+#include "FFFrameReader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    define NOMINMAX
+#    include <Windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Fmc {
+static constexpr char s_cropTrackMagic[4] = {'F', 'M', 'C', 'T'};
+static constexpr uint32_t s_cropTrackVersion = 1;
+
+static_assert(sizeof(CropTrackHeader) == 32, "Crop track header must be tightly packed");
+static_assert(sizeof(CropPosition) == 2 * sizeof(uint32_t), "Crop position must be tightly packed");
+
+static bool isLittleEndian() noexcept
+{
+    const uint32_t value = 1;
+    uint8_t first;
+    memcpy(&first, &value, 1);
+    return first == 1;
+}
+
+CropTrack::~CropTrack()
+{
+    if (m_data != nullptr) {
+#if defined(_WIN32)
+        UnmapViewOfFile(m_data);
+#else
+        munmap(const_cast<uint8_t*>(m_data), static_cast<size_t>(m_size));
+#endif
+    }
+}
+
+CropTrack::CropTrack(const uint8_t* data, const uint64_t size, ConstructorLock) noexcept
+    : m_data(data)
+    , m_size(size)
+{}
+
+shared_ptr<CropTrack> CropTrack::getCropTrack(const string& fileName) noexcept
+{
+    if (!isLittleEndian()) {
+        Ffr::log("Crop track files are only supported on little-endian systems"s, Ffr::LogLevel::Error);
+        return nullptr;
+    }
+
+    // Map the file into memory
+    const uint8_t* data = nullptr;
+    uint64_t size = 0;
+#if defined(_WIN32)
+    const auto file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        Ffr::log("Failed to open crop track file: "s += fileName, Ffr::LogLevel::Error);
+        return nullptr;
+    }
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= static_cast<LONGLONG>(sizeof(CropTrackHeader))) {
+        size = static_cast<uint64_t>(fileSize.QuadPart);
+        const auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+            data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            // The view holds its own reference to the mapping
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    const auto file = open(fileName.c_str(), O_RDONLY);
+    if (file < 0) {
+        Ffr::log("Failed to open crop track file: "s += fileName, Ffr::LogLevel::Error);
+        return nullptr;
+    }
+    struct stat fileStat;
+    if (fstat(file, &fileStat) == 0 && fileStat.st_size >= static_cast<off_t>(sizeof(CropTrackHeader))) {
+        size = static_cast<uint64_t>(fileStat.st_size);
+        auto map = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, file, 0);
+        if (map != MAP_FAILED) {
+            data = static_cast<const uint8_t*>(map);
+        }
+    }
+    // The mapping remains valid after the file is closed
+    close(file);
+#endif
+    if (data == nullptr) {
+        Ffr::log("Failed to map crop track file: "s += fileName, Ffr::LogLevel::Error);
+        return nullptr;
+    }
+    auto ret = make_shared<CropTrack>(data, size, ConstructorLock());
+
+    // Validate the header against the file contents
+    const auto header = reinterpret_cast<const CropTrackHeader*>(data);
+    if (memcmp(header->m_magic, s_cropTrackMagic, sizeof(s_cropTrackMagic)) != 0) {
+        Ffr::log("Invalid crop track file: "s += fileName, Ffr::LogLevel::Error);
+        return nullptr;
+    }
+    if (header->m_version != s_cropTrackVersion) {
+        Ffr::log("Unsupported crop track file version ("s += to_string(header->m_version) += "): "s += fileName,
+            Ffr::LogLevel::Error);
+        return nullptr;
+    }
+    const uint64_t available = size - sizeof(CropTrackHeader);
+    const uint64_t maxSkipRegions = available / (2 * sizeof(uint64_t));
+    if (header->m_numSkipRegions > maxSkipRegions ||
+        header->m_numCrops > (available - header->m_numSkipRegions * 2 * sizeof(uint64_t)) / sizeof(CropPosition)) {
+        Ffr::log("Crop track file is truncated: "s += fileName, Ffr::LogLevel::Error);
+        return nullptr;
+    }
+    return ret;
+}
+
+Resolution CropTrack::getResolution() const noexcept
+{
+    const auto header = reinterpret_cast<const CropTrackHeader*>(m_data);
+    return {header->m_width, header->m_height};
+}
+
+vector<pair<uint64_t, uint64_t>> CropTrack::getSkipRegions() const noexcept
+{
+    const auto header = reinterpret_cast<const CropTrackHeader*>(m_data);
+    const auto regions = reinterpret_cast<const uint64_t*>(m_data + sizeof(CropTrackHeader));
+    vector<pair<uint64_t, uint64_t>> ret;
+    ret.reserve(static_cast<size_t>(header->m_numSkipRegions));
+    for (uint64_t i = 0; i < header->m_numSkipRegions; ++i) {
+        ret.emplace_back(regions[i * 2], regions[i * 2 + 1]);
+    }
+    return ret;
+}
+
+uint64_t CropTrack::getNumCrops() const noexcept
+{
+    return reinterpret_cast<const CropTrackHeader*>(m_data)->m_numCrops;
+}
+
+const CropPosition* CropTrack::getCrops() const noexcept
+{
+    const auto header = reinterpret_cast<const CropTrackHeader*>(m_data);
+    return reinterpret_cast<const CropPosition*>(
+        m_data + sizeof(CropTrackHeader) + header->m_numSkipRegions * 2 * sizeof(uint64_t));
+}
+
+bool loadCropTrack(const string& trackFile, CropOptions& options) noexcept
+{
+    auto track = CropTrack::getCropTrack(trackFile);
+    if (track == nullptr) {
+        return false;
+    }
+    options.m_resolution = track->getResolution();
+    options.m_skipRegions = track->getSkipRegions();
+    options.m_cropList.clear();
+    options.m_cropTrack = move(track);
+    return true;
+}
+
+bool saveCropTrack(const string& trackFile, const CropOptions& options) noexcept
+{
+    if (!isLittleEndian()) {
+        Ffr::log("Crop track files are only supported on little-endian systems"s, Ffr::LogLevel::Error);
+        return false;
+    }
+    CropTrackHeader header;
+    memcpy(header.m_magic, s_cropTrackMagic, sizeof(s_cropTrackMagic));
+    header.m_version = s_cropTrackVersion;
+    header.m_width = options.m_resolution.m_width;
+    header.m_height = options.m_resolution.m_height;
+    header.m_numSkipRegions = options.m_skipRegions.size();
+    header.m_numCrops = options.getNumCrops();
+
+    // Write to a temporary file first as the crops may be mapped from the file that is being replaced
+    const auto tempFile = trackFile + "." +
+        to_string(chrono::steady_clock::now().time_since_epoch().count() ^ reinterpret_cast<uintptr_t>(&options));
+    {
+        ofstream file(tempFile, ios::binary | ios::trunc);
+        if (!file.is_open()) {
+            Ffr::log("Failed to create crop track file: "s += trackFile, Ffr::LogLevel::Error);
+            return false;
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& i : options.m_skipRegions) {
+            const uint64_t region[2] = {i.first, i.second};
+            file.write(reinterpret_cast<const char*>(region), sizeof(region));
+        }
+        if (options.m_cropTrack != nullptr) {
+            file.write(reinterpret_cast<const char*>(options.m_cropTrack->getCrops()),
+                static_cast<streamsize>(header.m_numCrops * sizeof(CropPosition)));
+        } else if (!options.m_cropList.empty()) {
+            file.write(reinterpret_cast<const char*>(options.m_cropList.data()),
+                static_cast<streamsize>(header.m_numCrops * sizeof(CropPosition)));
+        }
+        if (!file.good()) {
+            file.close();
+            remove(tempFile.c_str());
+            Ffr::log("Failed to write crop track file: "s += trackFile, Ffr::LogLevel::Error);
+            return false;
+        }
+    }
+#if defined(_WIN32)
+    // Windows rename does not replace existing files
+    remove(trackFile.c_str());
+#endif
+    if (rename(tempFile.c_str(), trackFile.c_str()) != 0) {
+        remove(tempFile.c_str());
+        Ffr::log("Failed to replace crop track file: "s += trackFile, Ffr::LogLevel::Error);
+        return false;
+    }
+    return true;
+}
+} // namespace Fmc
@@ -0,0 +1,97 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFMCEncoderOptions.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace Fmc {
+const EncoderOptions& getEncoderOptions(const CropOptions& cropOptions, const EncoderOptions& options) noexcept
+{
+    return cropOptions.m_overrideEncoderOptions ? cropOptions.m_encoderOptions : options;
+}
+
+double getEncodeCost(const Resolution& resolution, const EncoderOptions& options) noexcept
+{
+    // Approximate relative encode time of each preset
+    double presetCost;
+    switch (options.m_preset) {
+        case EncoderOptions::Preset::Ultrafast:
+            presetCost = 1.0;
+            break;
+        case EncoderOptions::Preset::Superfast:
+            presetCost = 1.5;
+            break;
+        case EncoderOptions::Preset::Veryfast:
+            presetCost = 2.0;
+            break;
+        case EncoderOptions::Preset::Faster:
+            presetCost = 3.0;
+            break;
+        case EncoderOptions::Preset::Fast:
+            presetCost = 4.0;
+            break;
+        case EncoderOptions::Preset::Medium:
+            presetCost = 5.0;
+            break;
+        case EncoderOptions::Preset::Slow:
+            presetCost = 8.0;
+            break;
+        case EncoderOptions::Preset::Slower:
+            presetCost = 14.0;
+            break;
+        case EncoderOptions::Preset::Veryslow:
+            presetCost = 30.0;
+            break;
+        case EncoderOptions::Preset::Placebo:
+            presetCost = 80.0;
+            break;
+        default:
+            presetCost = 5.0;
+            break;
+    }
+    const double codecCost = (options.m_type == EncodeType::h265) ? 2.0 : 1.0;
+    return std::max(static_cast<double>(resolution.m_width) * static_cast<double>(resolution.m_height), 1.0) *
+        presetCost * codecCost;
+}
+
+vector<uint32_t> getNumThreads(
+    const vector<CropOptions>& cropList, const EncoderOptions& options, uint32_t threads) noexcept
+{
+    vector<uint32_t> ret;
+    vector<double> costs;
+    double totalCost = 0.0;
+    for (const auto& i : cropList) {
+        const auto& encoderOptions = getEncoderOptions(i, options);
+        ret.push_back(encoderOptions.m_numThreads);
+        if (encoderOptions.m_numThreads != 0) {
+            threads -= std::min(threads, encoderOptions.m_numThreads);
+            costs.push_back(0.0);
+        } else {
+            costs.push_back(getEncodeCost(i.m_resolution, encoderOptions));
+            totalCost += costs.back();
+        }
+    }
+    for (size_t i = 0; i < ret.size(); ++i) {
+        if (ret[i] == 0) {
+            // Outputs with equal cost get the same number of threads as an even split
+            ret[i] = std::max(static_cast<uint32_t>(static_cast<double>(threads) * costs[i] / totalCost), 2U);
+        }
+    }
+    return ret;
+}
+} // namespace Fmc
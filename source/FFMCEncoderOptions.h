@@ -0,0 +1,50 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "FFMultiCrop.h"
+
+#include <vector>
+
+namespace Fmc {
+/**
+ * Gets the encoder options used for an output.
+ * @param cropOptions The output crop options.
+ * @param options     The options passed to the encode function.
+ * @returns The output's own options if it overrides them, otherwise the passed in options.
+ */
+FFMULTICROP_NO_EXPORT const EncoderOptions& getEncoderOptions(
+    const CropOptions& cropOptions, const EncoderOptions& options) noexcept;
+
+/**
+ * Gets the relative cost of encoding an output.
+ * @param resolution The output resolution.
+ * @param options    The output encoder options.
+ * @returns The cost.
+ */
+FFMULTICROP_NO_EXPORT double getEncodeCost(const Resolution& resolution, const EncoderOptions& options) noexcept;
+
+/**
+ * Gets the number of encoder threads to use for each output. Outputs that do not specify a thread count share the
+ * remaining threads in proportion to their relative encode cost, with a minimum of 2 threads each.
+ * @param cropList List of crop options for each output.
+ * @param options  The options passed to the encode function.
+ * @param threads  The number of available hardware threads.
+ * @returns The number of threads for each output.
+ */
+FFMULTICROP_NO_EXPORT std::vector<uint32_t> getNumThreads(
+    const std::vector<CropOptions>& cropList, const EncoderOptions& options, uint32_t threads) noexcept;
+} // namespace Fmc
@@ -0,0 +1,192 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFMCSourceIndex.h"
+
+#include "FFFrameReader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    define NOMINMAX
+#    include <Windows.h>
+#else
+#    include <sys/stat.h>
+#    include <sys/types.h>
+#endif
+
+using namespace std;
+
+namespace Fmc {
+static constexpr char s_sourceIndexMagic[4] = {'F', 'M', 'C', 'I'};
+static constexpr uint32_t s_sourceIndexVersion = 2;
+static const string s_sourceIndexExtension = ".ffmcidx"s;
+
+struct SourceIndexHeader
+{
+    char m_magic[4];          /**< File identifier, must be "FMCI" */
+    uint32_t m_version;       /**< File format version */
+    FileIdentity m_identity;  /**< Identity of the source file */
+    uint32_t m_width;         /**< The width of the source video */
+    uint32_t m_height;        /**< The height of the source video */
+    int64_t m_indexedFrames;  /**< Number of frames covered by the index */
+    uint32_t m_complete;      /**< Non-zero if the index covers the entire source */
+    uint32_t m_reserved;      /**< Unused padding */
+    uint64_t m_numKeyFrames;  /**< Number of key frame numbers stored after the header */
+};
+
+bool SourceIndex::getFileIdentity(const string& fileName, FileIdentity& identity) noexcept
+{
+    identity = FileIdentity();
+#if defined(_WIN32)
+    const auto file = CreateFileA(fileName.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    BY_HANDLE_FILE_INFORMATION info;
+    const bool valid = GetFileInformationByHandle(file, &info) != 0;
+    CloseHandle(file);
+    if (!valid) {
+        return false;
+    }
+    identity.m_fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    // File times are in 100ns intervals
+    identity.m_modifiedTime = static_cast<int64_t>(
+        ((static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime) *
+        100);
+    identity.m_fileId = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    identity.m_deviceId = info.dwVolumeSerialNumber;
+#else
+    struct stat fileStat;
+    if (stat(fileName.c_str(), &fileStat) != 0) {
+        return false;
+    }
+    identity.m_fileSize = static_cast<uint64_t>(fileStat.st_size);
+#    if defined(__APPLE__)
+    const auto& modified = fileStat.st_mtimespec;
+#    else
+    const auto& modified = fileStat.st_mtim;
+#    endif
+    identity.m_modifiedTime =
+        static_cast<int64_t>(modified.tv_sec) * 1000000000 + static_cast<int64_t>(modified.tv_nsec);
+    identity.m_fileId = static_cast<uint64_t>(fileStat.st_ino);
+    identity.m_deviceId = static_cast<uint64_t>(fileStat.st_dev);
+#endif
+    return true;
+}
+
+shared_ptr<SourceIndex> SourceIndex::loadSourceIndex(const string& sourceFile) noexcept
+{
+    FileIdentity identity;
+    if (!getFileIdentity(sourceFile, identity)) {
+        return nullptr;
+    }
+    ifstream file(getIndexFile(sourceFile), ios::binary);
+    if (!file.is_open()) {
+        return nullptr;
+    }
+    SourceIndexHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.m_magic, s_sourceIndexMagic, sizeof(s_sourceIndexMagic)) != 0 ||
+        header.m_version != s_sourceIndexVersion) {
+        Ffr::log("Ignoring invalid source index for: "s += sourceFile, Ffr::LogLevel::Warning);
+        return nullptr;
+    }
+    if (memcmp(&header.m_identity, &identity, sizeof(identity)) != 0) {
+        // Source has changed since the index was created
+        return nullptr;
+    }
+    if (header.m_numKeyFrames > static_cast<uint64_t>(header.m_indexedFrames)) {
+        Ffr::log("Ignoring invalid source index for: "s += sourceFile, Ffr::LogLevel::Warning);
+        return nullptr;
+    }
+    auto ret = make_shared<SourceIndex>();
+    ret->m_width = header.m_width;
+    ret->m_height = header.m_height;
+    ret->m_indexedFrames = header.m_indexedFrames;
+    ret->m_complete = header.m_complete != 0;
+    ret->m_keyFrames.resize(static_cast<size_t>(header.m_numKeyFrames));
+    if (!file.read(reinterpret_cast<char*>(ret->m_keyFrames.data()),
+            static_cast<streamsize>(ret->m_keyFrames.size() * sizeof(int64_t)))) {
+        Ffr::log("Ignoring truncated source index for: "s += sourceFile, Ffr::LogLevel::Warning);
+        return nullptr;
+    }
+    return ret;
+}
+
+bool SourceIndex::saveSourceIndex(const string& sourceFile, const FileIdentity& identity) const noexcept
+{
+    SourceIndexHeader header;
+    memcpy(header.m_magic, s_sourceIndexMagic, sizeof(s_sourceIndexMagic));
+    header.m_version = s_sourceIndexVersion;
+    header.m_identity = identity;
+    header.m_width = m_width;
+    header.m_height = m_height;
+    header.m_indexedFrames = m_indexedFrames;
+    header.m_complete = m_complete ? 1 : 0;
+    header.m_reserved = 0;
+    header.m_numKeyFrames = m_keyFrames.size();
+
+    // Write to a temporary file first so that other jobs never see a partially written index
+    const auto indexFile = getIndexFile(sourceFile);
+    const auto tempFile = indexFile + "." +
+        to_string(chrono::steady_clock::now().time_since_epoch().count() ^ reinterpret_cast<uintptr_t>(this));
+    {
+        ofstream file(tempFile, ios::binary | ios::trunc);
+        if (!file.is_open()) {
+            Ffr::log("Unable to create source index: "s += indexFile, Ffr::LogLevel::Info);
+            return false;
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(m_keyFrames.data()),
+            static_cast<streamsize>(m_keyFrames.size() * sizeof(int64_t)));
+        if (!file.good()) {
+            file.close();
+            remove(tempFile.c_str());
+            Ffr::log("Failed to write source index: "s += indexFile, Ffr::LogLevel::Warning);
+            return false;
+        }
+    }
+#if defined(_WIN32)
+    // Windows rename does not replace existing files
+    remove(indexFile.c_str());
+#endif
+    if (rename(tempFile.c_str(), indexFile.c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SourceIndex::hasKeyFrame(const int64_t first, const int64_t last) const noexcept
+{
+    if (!m_complete && last >= m_indexedFrames) {
+        return true;
+    }
+    const auto keyFrame = upper_bound(m_keyFrames.cbegin(), m_keyFrames.cend(), first);
+    return keyFrame != m_keyFrames.cend() && *keyFrame <= last;
+}
+
+string SourceIndex::getIndexFile(const string& sourceFile) noexcept
+{
+    return sourceFile + s_sourceIndexExtension;
+}
+} // namespace Fmc
@@ -0,0 +1,89 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "FFMultiCrop.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Fmc {
+struct FileIdentity
+{
+    uint64_t m_fileSize = 0;    /**< Size of the file */
+    int64_t m_modifiedTime = 0; /**< Modification time of the file in nanoseconds */
+    uint64_t m_fileId = 0;      /**< File serial number (inode) */
+    uint64_t m_deviceId = 0;    /**< Device (volume) containing the file */
+};
+
+/**
+ * Index of a source video that is cached on disk in a sidecar file next to the source.
+ * The sidecar is keyed by the size, modification time and file id of the source so that a changed source invalidates
+ * it.
+ */
+class SourceIndex
+{
+public:
+    uint32_t m_width = 0;         /**< The width of the source video */
+    uint32_t m_height = 0;        /**< The height of the source video */
+    int64_t m_indexedFrames = 0;  /**< Number of frames from the start of the source covered by the index */
+    bool m_complete = false;      /**< True if the index covers the entire source (m_indexedFrames is exact) */
+    std::vector<int64_t> m_keyFrames; /**< Ascending list of key frame numbers within the indexed frames */
+
+    /**
+     * Loads the cached index for a source video.
+     * @param sourceFile Source video.
+     * @returns The index if a valid sidecar exists, nullptr otherwise.
+     */
+    FFMULTICROP_NO_EXPORT static std::shared_ptr<SourceIndex> loadSourceIndex(const std::string& sourceFile) noexcept;
+
+    /**
+     * Saves the index as the sidecar for a source video.
+     * @param sourceFile Source video.
+     * @param identity   The identity of the source when it was opened to create the index, a source that has changed
+     *  since then no longer matches the saved index.
+     * @returns True if it succeeds, false if it fails.
+     */
+    FFMULTICROP_NO_EXPORT bool saveSourceIndex(const std::string& sourceFile, const FileIdentity& identity) const
+        noexcept;
+
+    /**
+     * Query if a key frame may exist in the range (first, last]. Key frames past the end of a partial index are
+     * unknown so are assumed to exist.
+     * @param first The frame to seek from.
+     * @param last  The frame to seek to.
+     * @returns True if seeking from first to last may skip at least 1 key frame.
+     */
+    FFMULTICROP_NO_EXPORT bool hasKeyFrame(int64_t first, int64_t last) const noexcept;
+
+    /**
+     * Gets the filename of the index sidecar for a source video.
+     * @param sourceFile Source video.
+     * @returns The sidecar filename.
+     */
+    FFMULTICROP_NO_EXPORT static std::string getIndexFile(const std::string& sourceFile) noexcept;
+
+    /**
+     * Gets the identity of a file. A file that is replaced or rewritten will have a different identity even if it has
+     * the same size and is modified within the same second.
+     * @param       fileName Filename of the file.
+     * @param [out] identity The identity of the file.
+     * @returns True if it succeeds, false if it fails.
+     */
+    FFMULTICROP_NO_EXPORT static bool getFileIdentity(const std::string& fileName, FileIdentity& identity) noexcept;
+};
+} // namespace Fmc
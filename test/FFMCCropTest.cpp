@@ -0,0 +1,384 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFFRTestData.h"
+#include "FFMCCrop.h"
+#include "FFMCSourceIndex.h"
+#include "FFFrameReader.h"
+#include "FFMultiCrop.h"
+
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <thread>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/crc.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+}
+
+using namespace Fmc;
+
+/**
+ * Calculates a checksum of each component of a frame region using the pixel format descriptor to read each pixel.
+ * This is independent of the pointer arithmetic used when cropping so can be used as a reference.
+ * @param frame  The frame.
+ * @param left   The offset in pixels from left of frame.
+ * @param top    The offset in pixels from top of frame.
+ * @param width  The width of the region.
+ * @param height The height of the region.
+ * @returns The checksum of each component.
+ */
+static std::vector<uint32_t> getChecksums(
+    const AVFrame* frame, const uint32_t left, const uint32_t top, const uint32_t width, const uint32_t height)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    const AVCRC* table = av_crc_get_table(AV_CRC_32_IEEE);
+    std::vector<uint32_t> ret;
+    std::vector<uint16_t> line(width);
+    for (int32_t c = 0; c < desc->nb_components; c++) {
+        // Chroma components are subsampled, the alpha component never is
+        const bool chroma = (c == 1 || c == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        const uint32_t shiftX = chroma ? desc->log2_chroma_w : 0;
+        const uint32_t shiftY = chroma ? desc->log2_chroma_h : 0;
+        const uint32_t compWidth = (width + (1U << shiftX) - 1) >> shiftX;
+        const uint32_t compHeight = (height + (1U << shiftY) - 1) >> shiftY;
+        uint32_t crc = 0;
+        for (uint32_t y = 0; y < compHeight; y++) {
+            av_read_image_line(line.data(), const_cast<const uint8_t**>(frame->data), frame->linesize, desc,
+                static_cast<int>(left >> shiftX), static_cast<int>((top >> shiftY) + y), c, static_cast<int>(compWidth),
+                0);
+            crc = av_crc(table, crc, reinterpret_cast<const uint8_t*>(line.data()), compWidth * sizeof(uint16_t));
+        }
+        ret.push_back(crc);
+    }
+    return ret;
+}
+
+/**
+ * Crops a frame and checks the result against a reference crop of the original frame.
+ * @param frame      The frame to crop.
+ * @param crop       The crop position.
+ * @param resolution The resolution of the cropped frame.
+ */
+static void checkCrop(const AVFrame* frame, const CropPosition& crop, const Resolution& resolution)
+{
+    AVFrame* cropped = av_frame_clone(frame);
+    ASSERT_NE(cropped, nullptr);
+    auto applied = crop;
+    ASSERT_TRUE(cropFrame(cropped, applied, resolution));
+
+    // Check crop was clamped correctly
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+    uint32_t expectedLeft = std::min(crop.m_left, static_cast<uint32_t>(frame->width) - resolution.m_width);
+    if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->log2_chroma_w) {
+        expectedLeft -= expectedLeft % (1U << desc->log2_chroma_w);
+    }
+    EXPECT_EQ(applied.m_top, std::min(crop.m_top, static_cast<uint32_t>(frame->height) - resolution.m_height));
+    EXPECT_EQ(applied.m_left, expectedLeft);
+    EXPECT_EQ(static_cast<uint32_t>(cropped->width), resolution.m_width);
+    EXPECT_EQ(static_cast<uint32_t>(cropped->height), resolution.m_height);
+
+    // Compare against reference crop
+    const auto reference = getChecksums(frame, applied.m_left, applied.m_top, resolution.m_width, resolution.m_height);
+    const auto result = getChecksums(cropped, 0, 0, resolution.m_width, resolution.m_height);
+    EXPECT_EQ(result, reference) << "pixel format: " << desc->name << ", crop: (" << crop.m_top << ", "
+                                 << crop.m_left << "), resolution: " << resolution.m_width << "x"
+                                 << resolution.m_height;
+    av_frame_free(&cropped);
+}
+
+class CropTestPixelFormat : public ::testing::TestWithParam<AVPixelFormat>
+{
+protected:
+    CropTestPixelFormat() = default;
+
+    void SetUp() override
+    {
+        Ffr::setLogLevel(Ffr::LogLevel::Error);
+
+        // Create a frame filled with a pattern that differs for every byte
+        m_frame = av_frame_alloc();
+        ASSERT_NE(m_frame, nullptr);
+        m_frame->format = GetParam();
+        m_frame->width = 67;
+        m_frame->height = 45;
+        ASSERT_GE(av_frame_get_buffer(m_frame, 0), 0);
+        uint32_t seed = 1;
+        for (uint32_t i = 0; i < AV_NUM_DATA_POINTERS && m_frame->buf[i] != nullptr; i++) {
+            for (size_t j = 0; j < static_cast<size_t>(m_frame->buf[i]->size); j++) {
+                seed = seed * 1103515245 + 12345;
+                m_frame->buf[i]->data[j] = static_cast<uint8_t>(seed >> 16);
+            }
+        }
+    }
+
+    void TearDown() override
+    {
+        av_frame_free(&m_frame);
+    }
+
+    AVFrame* m_frame = nullptr;
+};
+
+TEST_P(CropTestPixelFormat, crop)
+{
+    const std::vector<Resolution> resolutions = {{32, 24}, {33, 25}, {67, 45}, {1, 1}};
+    const std::vector<CropPosition> crops = {
+        {0, 0}, {1, 1}, {2, 3}, {5, 7}, {8, 16}, {20, 34}, {44, 66}, {UINT32_MAX - 1, UINT32_MAX - 1}};
+    for (const auto& i : resolutions) {
+        for (const auto& j : crops) {
+            checkCrop(m_frame, j, i);
+        }
+    }
+}
+
+TEST_P(CropTestPixelFormat, invalidResolution)
+{
+    CropPosition crop = {0, 0};
+    ASSERT_FALSE(cropFrame(m_frame, crop, {68, 45}));
+    ASSERT_FALSE(cropFrame(m_frame, crop, {67, 46}));
+}
+
+INSTANTIATE_TEST_SUITE_P(CropTestData, CropTestPixelFormat,
+    ::testing::Values(AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV444P,
+        AV_PIX_FMT_YUV440P, AV_PIX_FMT_YUV411P, AV_PIX_FMT_YUV410P, AV_PIX_FMT_YUVA420P, AV_PIX_FMT_YUVA444P,
+        AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_YUV422P10LE, AV_PIX_FMT_YUV444P12LE, AV_PIX_FMT_NV12, AV_PIX_FMT_NV21,
+        AV_PIX_FMT_NV16, AV_PIX_FMT_P010LE, AV_PIX_FMT_YUYV422, AV_PIX_FMT_UYVY422, AV_PIX_FMT_RGB24,
+        AV_PIX_FMT_BGR24, AV_PIX_FMT_RGBA, AV_PIX_FMT_BGR0, AV_PIX_FMT_RGB48LE, AV_PIX_FMT_GRAY8, AV_PIX_FMT_GRAY16LE,
+        AV_PIX_FMT_YA8, AV_PIX_FMT_GBRP, AV_PIX_FMT_GBRAP, AV_PIX_FMT_GBRP10LE, AV_PIX_FMT_PAL8));
+
+TEST(CropTest, skipRegions)
+{
+    // Create crops that encode their own index so that the returned crop identifies the list entry used
+    CropOptions options;
+    for (uint32_t i = 0; i < 500; i++) {
+        options.m_cropList.push_back({i, i * 2});
+    }
+    options.m_skipRegions = {{0, 10}, {10, 25}, {100, 101}, {300, 400}};
+
+    // Build reference mapping from frame to crop index
+    std::vector<bool> skipped(1000, false);
+    for (const auto& i : options.m_skipRegions) {
+        for (uint64_t j = i.first; j < i.second; j++) {
+            skipped[j] = true;
+        }
+    }
+    uint32_t index = 0;
+    for (uint64_t i = 0; i < skipped.size(); i++) {
+        const auto crop = options.getCrop(i);
+        if (skipped[i] || index >= options.m_cropList.size()) {
+            EXPECT_EQ(crop.m_top, UINT32_MAX) << "frame: " << i;
+            EXPECT_EQ(crop.m_left, UINT32_MAX) << "frame: " << i;
+        } else {
+            EXPECT_EQ(crop.m_top, index) << "frame: " << i;
+            EXPECT_EQ(crop.m_left, index * 2) << "frame: " << i;
+            ++index;
+        }
+    }
+    ASSERT_EQ(index, options.m_cropList.size());
+}
+
+TEST(CropTest, decodedFrames)
+{
+    // Crop real decoded frames using clamped and odd offsets
+    Ffr::setLogLevel(Ffr::LogLevel::Error);
+    auto stream = Ffr::Stream::getStream(g_testData[0].m_fileName);
+    ASSERT_NE(stream, nullptr);
+    const Resolution resolution = {stream->getWidth() / 3 + 1, stream->getHeight() / 3 + 1};
+    for (uint32_t i = 0; i < 50; i++) {
+        auto frame = stream->getNextFrame();
+        ASSERT_NE(frame, nullptr);
+        const CropPosition crop = {i * 13, i * 31};
+        checkCrop(frame->m_frame.m_frame, crop, resolution);
+    }
+}
+
+class CropTestEncode : public ::testing::Test
+{
+protected:
+    CropTestEncode() = default;
+
+    void SetUp() override
+    {
+        Ffr::setLogLevel(Ffr::LogLevel::Error);
+        auto stream = Ffr::Stream::getStream(g_testData[0].m_fileName);
+        ASSERT_NE(stream, nullptr);
+        m_width = stream->getWidth();
+        m_height = stream->getHeight();
+
+        // Encode losslessly so that the decoded outputs can be compared exactly
+        m_options.m_type = EncodeType::h264;
+        m_options.m_quality = 255;
+        m_options.m_preset = EncoderOptions::Preset::Ultrafast;
+    }
+
+    void TearDown() override
+    {
+        // Never leave a source index behind as it would change the decode path used by other tests
+        setSourceIndexCache(false);
+        remove(SourceIndex::getIndexFile(g_testData[0].m_fileName).c_str());
+    }
+
+    /**
+     * Creates crop options with odd and out of range crop values.
+     * @param fileName    Filename of the output.
+     * @param numCrops    Number of crops.
+     * @param skipRegions The skip regions.
+     * @param seed        Offset used to vary the crops between outputs.
+     * @returns The crop options.
+     */
+    CropOptions getCropOptions(const std::string& fileName, const uint32_t numCrops,
+        const std::vector<std::pair<uint64_t, uint64_t>>& skipRegions, const uint32_t seed) const
+    {
+        CropOptions options;
+        options.m_resolution = {m_width / 3 + 1, m_height / 3 + 1};
+        options.m_fileName = fileName;
+        options.m_skipRegions = skipRegions;
+        for (uint32_t i = 0; i < numCrops; i++) {
+            // Values range past the frame edge so that some crops are clamped
+            options.m_cropList.push_back(
+                {(i * 37 + seed) % (m_height - m_height / 3 + 40), (i * 53 + seed * 7) % (m_width - m_width / 3 + 40)});
+        }
+        return options;
+    }
+
+    /**
+     * Decodes an output and checks each frame against a reference crop of the matching source frame.
+     * @param options The crop options used to create the output.
+     */
+    static void checkOutput(const CropOptions& options)
+    {
+        auto source = Ffr::Stream::getStream(g_testData[0].m_fileName);
+        ASSERT_NE(source, nullptr);
+        auto output = Ffr::Stream::getStream(options.m_fileName);
+        ASSERT_NE(output, nullptr);
+        const auto& resolution = options.m_resolution;
+
+        uint32_t index = 0;
+        while (index < options.m_cropList.size()) {
+            auto sourceFrame = source->getNextFrame();
+            ASSERT_NE(sourceFrame, nullptr);
+            // Map the source frame to the output frame independently of the crop options
+            const auto frameNum = static_cast<uint64_t>(sourceFrame->getFrameNumber());
+            bool skipped = false;
+            for (const auto& i : options.m_skipRegions) {
+                skipped = skipped || (frameNum >= i.first && frameNum < i.second);
+            }
+            if (skipped) {
+                continue;
+            }
+            const AVFrame* frame = sourceFrame->m_frame.m_frame;
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+            const auto& crop = options.m_cropList[index];
+            const uint32_t top = std::min(crop.m_top, static_cast<uint32_t>(frame->height) - resolution.m_height);
+            uint32_t left = std::min(crop.m_left, static_cast<uint32_t>(frame->width) - resolution.m_width);
+            if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->log2_chroma_w) {
+                left -= left % (1U << desc->log2_chroma_w);
+            }
+
+            auto outputFrame = output->getNextFrame();
+            ASSERT_NE(outputFrame, nullptr) << "output: " << options.m_fileName << ", frame: " << index;
+            // Frame numbers are derived from timestamps so skip regions must not leave gaps
+            ASSERT_EQ(outputFrame->getFrameNumber(), static_cast<int64_t>(index)) << "output: " << options.m_fileName;
+            ASSERT_EQ(static_cast<uint32_t>(outputFrame->m_frame->width), resolution.m_width);
+            ASSERT_EQ(static_cast<uint32_t>(outputFrame->m_frame->height), resolution.m_height);
+            EXPECT_EQ(getChecksums(outputFrame->m_frame.m_frame, 0, 0, resolution.m_width, resolution.m_height),
+                getChecksums(frame, left, top, resolution.m_width, resolution.m_height))
+                << "output: " << options.m_fileName << ", frame: " << index << ", source frame: " << frameNum;
+            ++index;
+        }
+        ASSERT_EQ(output->getNextFrame(), nullptr) << "output: " << options.m_fileName;
+    }
+
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    EncoderOptions m_options;
+};
+
+TEST_F(CropTestEncode, encode)
+{
+    // Multiple outputs with different skip regions from a single decode
+    const std::vector<CropOptions> cropOps = {getCropOptions("test-exact-1.mkv", 60, {{5, 12}, {30, 31}}, 0),
+        getCropOptions("test-exact-2.mkv", 50, {{0, 3}, {20, 40}}, 11)};
+    ASSERT_TRUE(cropAndEncode(g_testData[0].m_fileName, cropOps, m_options));
+    for (const auto& i : cropOps) {
+        checkOutput(i);
+    }
+}
+
+TEST_F(CropTestEncode, encodeShared)
+{
+    // A long running job and a second job that attaches part way through so that it decodes its missed frames
+    // separately and then receives the remaining frames from the shared decode
+    const std::vector<CropOptions> cropOps1 = {getCropOptions("test-exact-shared-1.mkv", 300, {{5, 12}}, 3),
+        getCropOptions("test-exact-shared-2.mkv", 250, {{100, 140}}, 5)};
+    const std::vector<CropOptions> cropOps2 = {getCropOptions("test-exact-shared-3.mkv", 120, {{10, 20}}, 7),
+        getCropOptions("test-exact-shared-4.mkv", 100, {{0, 30}, {60, 61}}, 13)};
+
+    auto server1 = cropAndEncodeAsync(g_testData[0].m_fileName, cropOps1, m_options);
+    ASSERT_NE(server1, nullptr);
+    while (server1->getStatus() == MultiCropServer::Status::Running && server1->getProgress() < 0.15f) {
+        std::this_thread::yield();
+    }
+    auto server2 = cropAndEncodeAsync(g_testData[0].m_fileName, cropOps2, m_options);
+    ASSERT_NE(server2, nullptr);
+    for (const auto& server : {server1, server2}) {
+        while (server->getStatus() == MultiCropServer::Status::Running) {
+            std::this_thread::yield();
+        }
+        ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Completed);
+    }
+
+    for (const auto& ops : {cropOps1, cropOps2}) {
+        for (const auto& i : ops) {
+            checkOutput(i);
+        }
+    }
+}
+
+TEST_F(CropTestEncode, encodeSeek)
+{
+    // Every output starts inside a skip region so the source is seeked to the first required frame before decoding
+    const std::vector<CropOptions> cropOps = {getCropOptions("test-exact-seek-1.mkv", 40, {{0, 400}, {420, 430}}, 2),
+        getCropOptions("test-exact-seek-2.mkv", 30, {{0, 350}}, 9)};
+    ASSERT_TRUE(cropAndEncode(g_testData[0].m_fileName, cropOps, m_options));
+    for (const auto& i : cropOps) {
+        checkOutput(i);
+    }
+}
+
+TEST_F(CropTestEncode, encodeIndexed)
+{
+    // Prime the source index with a decode from the start of the source
+    const auto& sourceFile = g_testData[0].m_fileName;
+    remove(SourceIndex::getIndexFile(sourceFile).c_str());
+    setSourceIndexCache(true);
+    ASSERT_TRUE(cropAndEncode(sourceFile, {getCropOptions("test-exact-indexed-prime.mkv", 800, {}, 0)}, m_options));
+    const auto index = SourceIndex::loadSourceIndex(sourceFile);
+    ASSERT_NE(index, nullptr);
+    ASSERT_GE(index->m_indexedFrames, 800);
+
+    // Every output starts inside a skip region and all outputs share a later skip region, so the index is used both
+    // for the seek to the first required frame and for the seek past the shared skip region during the decode
+    const std::vector<CropOptions> cropOps = {
+        getCropOptions("test-exact-indexed-1.mkv", 60, {{0, 300}, {320, 700}}, 4),
+        getCropOptions("test-exact-indexed-2.mkv", 50, {{0, 310}, {330, 720}}, 6)};
+    ASSERT_TRUE(cropAndEncode(sourceFile, cropOps, m_options));
+    for (const auto& i : cropOps) {
+        checkOutput(i);
+    }
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFMCEncoderOptions.h"
+
+#include <gtest/gtest.h>
+
+using namespace Fmc;
+
+static CropOptions s_master = {{}, {1920, 1080}, "test-master.mkv"};
+static CropOptions s_preview = {{}, {1920, 1080}, "test-preview.mkv"};
+
+TEST(EncoderOptionsTest, getEncoderOptions)
+{
+    EncoderOptions options;
+    CropOptions cropOptions = s_preview;
+    ASSERT_EQ(&getEncoderOptions(cropOptions, options), &options);
+
+    cropOptions.m_overrideEncoderOptions = true;
+    cropOptions.m_encoderOptions.m_quality = 10;
+    ASSERT_EQ(&getEncoderOptions(cropOptions, options), &cropOptions.m_encoderOptions);
+    ASSERT_EQ(getEncoderOptions(cropOptions, options).m_quality, 10);
+}
+
+TEST(EncoderOptionsTest, getEncodeCost)
+{
+    EncoderOptions options;
+    const auto defaultCost = getEncodeCost(s_master.m_resolution, options);
+    options.m_preset = EncoderOptions::Preset::Medium;
+    ASSERT_DOUBLE_EQ(getEncodeCost(s_master.m_resolution, options), defaultCost);
+    options.m_preset = EncoderOptions::Preset::Fast;
+    ASSERT_LT(getEncodeCost(s_master.m_resolution, options), defaultCost);
+    options.m_preset = EncoderOptions::Preset::Slow;
+    ASSERT_GT(getEncodeCost(s_master.m_resolution, options), defaultCost);
+
+    options.m_preset = EncoderOptions::Preset::Medium;
+    options.m_type = EncodeType::h265;
+    ASSERT_GT(getEncodeCost(s_master.m_resolution, options), defaultCost);
+    options.m_type = EncodeType::h264;
+    ASSERT_LT(getEncodeCost({640, 480}, options), defaultCost);
+}
+
+TEST(EncoderOptionsTest, getNumThreadsEven)
+{
+    // Equal outputs get an even split of the available threads
+    const EncoderOptions options;
+    const std::vector<CropOptions> cropList = {s_master, s_master, s_master};
+    ASSERT_EQ(getNumThreads(cropList, options, 12), std::vector<uint32_t>({4, 4, 4}));
+    ASSERT_EQ(getNumThreads(cropList, options, 13), std::vector<uint32_t>({4, 4, 4}));
+}
+
+TEST(EncoderOptionsTest, getNumThreadsMinimum)
+{
+    // Every output gets at least 2 threads even when there are more outputs than threads
+    const EncoderOptions options;
+    const std::vector<CropOptions> cropList = {s_master, s_master, s_master};
+    ASSERT_EQ(getNumThreads(cropList, options, 2), std::vector<uint32_t>({2, 2, 2}));
+    ASSERT_EQ(getNumThreads(cropList, options, 0), std::vector<uint32_t>({2, 2, 2}));
+}
+
+TEST(EncoderOptionsTest, getNumThreadsExplicit)
+{
+    // Outputs with an explicit thread count keep it and the rest share what remains
+    EncoderOptions options;
+    std::vector<CropOptions> cropList = {s_master, s_master, s_master};
+    cropList[0].m_overrideEncoderOptions = true;
+    cropList[0].m_encoderOptions.m_numThreads = 8;
+    ASSERT_EQ(getNumThreads(cropList, options, 16), std::vector<uint32_t>({8, 4, 4}));
+
+    options.m_numThreads = 3;
+    ASSERT_EQ(getNumThreads(cropList, options, 16), std::vector<uint32_t>({8, 3, 3}));
+}
+
+TEST(EncoderOptionsTest, getNumThreadsPreset)
+{
+    // A fast preview gets fewer threads than a master encoded with the default preset
+    const EncoderOptions options;
+    std::vector<CropOptions> cropList = {s_master, s_preview};
+    cropList[1].m_overrideEncoderOptions = true;
+    cropList[1].m_encoderOptions.m_preset = EncoderOptions::Preset::Ultrafast;
+    const auto threads = getNumThreads(cropList, options, 12);
+    ASSERT_EQ(threads, std::vector<uint32_t>({10, 2}));
+
+    // A medium preset output is costed the same as the default preset
+    cropList[1].m_encoderOptions.m_preset = EncoderOptions::Preset::Medium;
+    ASSERT_EQ(getNumThreads(cropList, options, 12), std::vector<uint32_t>({6, 6}));
+}
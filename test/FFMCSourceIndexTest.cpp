@@ -0,0 +1,150 @@
+/**
+ * Copyright 2019 Matthew Oliver
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "FFMCSourceIndex.h"
+
+#include <cstdio>
+#include <fstream>
+#include <gtest/gtest.h>
+
+using namespace Fmc;
+
+class SourceIndexTest : public ::testing::Test
+{
+protected:
+    SourceIndexTest() = default;
+
+    void SetUp() override
+    {
+        writeSource(m_sourceFile, 'a');
+        m_index.m_width = 1920;
+        m_index.m_height = 1080;
+        m_index.m_indexedFrames = 100;
+        m_index.m_complete = true;
+        m_index.m_keyFrames = {0, 30, 60, 90};
+    }
+
+    void TearDown() override
+    {
+        remove(SourceIndex::getIndexFile(m_sourceFile).c_str());
+        remove(m_sourceFile.c_str());
+    }
+
+    static void writeSource(const std::string& fileName, const char fill)
+    {
+        std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+        ASSERT_TRUE(file.is_open());
+        file << std::string(1024, fill);
+    }
+
+    FileIdentity getIdentity() const
+    {
+        FileIdentity identity;
+        EXPECT_TRUE(SourceIndex::getFileIdentity(m_sourceFile, identity));
+        return identity;
+    }
+
+    std::string m_sourceFile = "test-source-index.bin";
+    SourceIndex m_index;
+};
+
+TEST_F(SourceIndexTest, saveLoad)
+{
+    ASSERT_EQ(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+    ASSERT_TRUE(m_index.saveSourceIndex(m_sourceFile, getIdentity()));
+
+    const auto index = SourceIndex::loadSourceIndex(m_sourceFile);
+    ASSERT_NE(index, nullptr);
+    ASSERT_EQ(index->m_width, m_index.m_width);
+    ASSERT_EQ(index->m_height, m_index.m_height);
+    ASSERT_EQ(index->m_indexedFrames, m_index.m_indexedFrames);
+    ASSERT_EQ(index->m_complete, m_index.m_complete);
+    ASSERT_EQ(index->m_keyFrames, m_index.m_keyFrames);
+}
+
+TEST_F(SourceIndexTest, invalidation)
+{
+    ASSERT_TRUE(m_index.saveSourceIndex(m_sourceFile, getIdentity()));
+    ASSERT_NE(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+
+    // Replace the source with a different file of the same size
+    const std::string tempFile = m_sourceFile + ".tmp";
+    writeSource(tempFile, 'b');
+#if defined(_WIN32)
+    remove(m_sourceFile.c_str());
+#endif
+    ASSERT_EQ(rename(tempFile.c_str(), m_sourceFile.c_str()), 0);
+    ASSERT_EQ(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+
+    // Change the size of the source
+    ASSERT_TRUE(m_index.saveSourceIndex(m_sourceFile, getIdentity()));
+    ASSERT_NE(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+    {
+        std::ofstream file(m_sourceFile, std::ios::binary | std::ios::app);
+        file << 'c';
+    }
+    ASSERT_EQ(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+}
+
+TEST_F(SourceIndexTest, staleIdentity)
+{
+    // An index saved with the identity from before the source changed must not match the changed source
+    const auto identity = getIdentity();
+    {
+        std::ofstream file(m_sourceFile, std::ios::binary | std::ios::app);
+        file << 'c';
+    }
+    ASSERT_TRUE(m_index.saveSourceIndex(m_sourceFile, identity));
+    ASSERT_EQ(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+}
+
+TEST_F(SourceIndexTest, truncated)
+{
+    ASSERT_TRUE(m_index.saveSourceIndex(m_sourceFile, getIdentity()));
+    const auto indexFile = SourceIndex::getIndexFile(m_sourceFile);
+    std::string data;
+    {
+        std::ifstream file(indexFile, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream file(indexFile, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), static_cast<std::streamsize>(data.size() - sizeof(int64_t)));
+    }
+    ASSERT_EQ(SourceIndex::loadSourceIndex(m_sourceFile), nullptr);
+}
+
+TEST_F(SourceIndexTest, hasKeyFrame)
+{
+    // Range is (first, last]
+    ASSERT_FALSE(m_index.hasKeyFrame(0, 29));
+    ASSERT_TRUE(m_index.hasKeyFrame(0, 30));
+    ASSERT_TRUE(m_index.hasKeyFrame(29, 30));
+    ASSERT_FALSE(m_index.hasKeyFrame(30, 59));
+    ASSERT_TRUE(m_index.hasKeyFrame(1, 99));
+    ASSERT_FALSE(m_index.hasKeyFrame(90, 1000));
+    ASSERT_FALSE(m_index.hasKeyFrame(60, 60));
+
+    // Key frames past the end of a partial index are unknown
+    SourceIndex partial = m_index;
+    partial.m_complete = false;
+    ASSERT_FALSE(partial.hasKeyFrame(0, 29));
+    ASSERT_FALSE(partial.hasKeyFrame(90, 99));
+    ASSERT_TRUE(partial.hasKeyFrame(90, 100));
+    ASSERT_TRUE(partial.hasKeyFrame(90, 1000));
+    ASSERT_TRUE(partial.hasKeyFrame(200, 1000));
+    SourceIndex empty;
+    ASSERT_TRUE(empty.hasKeyFrame(0, 1000));
+}
@@ -15,9 +15,14 @@
  */
 #include "FFFRTestData.h"
 #include "FFFrameReader.h"
+#include "FFMCCropTrack.h"
+#include "FFMCSourceIndex.h"
 #include "FFMultiCrop.h"
 
+#include <cstdio>
+#include <fstream>
 #include <gtest/gtest.h>
+#include <thread>
 using namespace Fmc;
 
 struct TestParamsEncode
@@ -75,7 +80,12 @@ protected:
         }
     }
 
-    void TearDown() override {}
+    void TearDown() override
+    {
+        // Never leave a source index behind as it would change the decode path used by other tests
+        setSourceIndexCache(false);
+        remove(SourceIndex::getIndexFile(g_testData[GetParam().m_testDataIndex].m_fileName).c_str());
+    }
 
     std::vector<CropOptions> m_cropOps;
 };
@@ -128,4 +138,349 @@ TEST_P(EncodeTest1, encodeStreamAsync)
     }
 }
 
+TEST_P(EncodeTest1, encodeStreamAsyncCancel)
+{
+    // Use different output name for this test
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "cancel-" + i.m_fileName;
+    }
+
+    // Use the slowest preset so that the job is still running long after it is cancelled
+    EncoderOptions options;
+    options.m_preset = EncoderOptions::Preset::Placebo;
+    auto server = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps, options);
+    ASSERT_NE(server, nullptr);
+    while (server->getStatus() == MultiCropServer::Status::Running && server->getProgress() <= 0.0f) {
+        std::this_thread::yield();
+    }
+    server->cancel();
+    ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Cancelled);
+
+    // Partial outputs should have been removed
+    for (const auto& i : m_cropOps) {
+        ASSERT_EQ(std::ifstream(i.m_fileName).is_open(), false);
+    }
+
+    // Cancelling a finished job has no effect
+    server->cancel();
+    ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Cancelled);
+}
+
+TEST_P(EncodeTest1, encodeStreamAsyncCancelPolled)
+{
+    // Use different output name for this test
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "cancelpolled-" + i.m_fileName;
+    }
+
+    EncoderOptions options;
+    options.m_preset = EncoderOptions::Preset::Placebo;
+    auto server = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps, options);
+    ASSERT_NE(server, nullptr);
+
+    // Poll the job from another thread while it is cancelled
+    std::thread poll([&server] {
+        while (server->getStatus() == MultiCropServer::Status::Running) {
+            server->getProgress();
+        }
+    });
+    while (server->getStatus() == MultiCropServer::Status::Running && server->getProgress() <= 0.0f) {
+        std::this_thread::yield();
+    }
+    server->cancel();
+    poll.join();
+    ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Cancelled);
+}
+
+TEST_P(EncodeTest1, encodeStreamAsyncRelease)
+{
+    // Use different output name for this test
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "release-" + i.m_fileName;
+    }
+
+    // Releasing the server of a running job cancels it instead of waiting for it to finish
+    EncoderOptions options;
+    options.m_preset = EncoderOptions::Preset::Placebo;
+    auto server = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps, options);
+    ASSERT_NE(server, nullptr);
+    while (server->getStatus() == MultiCropServer::Status::Running && server->getProgress() <= 0.0f) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Running);
+    server = nullptr;
+
+    for (const auto& i : m_cropOps) {
+        ASSERT_EQ(std::ifstream(i.m_fileName).is_open(), false);
+    }
+}
+
+TEST_P(EncodeTest1, encodeStreamAsyncCancelShared)
+{
+    // Create a second set of outputs for a job that shares the decode of the first
+    std::vector<CropOptions> cropOps2 = m_cropOps;
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "cancelshared1-" + i.m_fileName;
+    }
+    for (auto& i : cropOps2) {
+        i.m_fileName = "cancelshared2-" + i.m_fileName;
+    }
+
+    // The first job is slow enough that it is still running when the second attaches and when it is cancelled
+    EncoderOptions options;
+    options.m_preset = EncoderOptions::Preset::Placebo;
+    auto server1 = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps, options);
+    ASSERT_NE(server1, nullptr);
+    while (server1->getStatus() == MultiCropServer::Status::Running && server1->getProgress() <= 0.0f) {
+        std::this_thread::yield();
+    }
+    auto server2 = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, cropOps2);
+    ASSERT_NE(server2, nullptr);
+
+    server1->cancel();
+    ASSERT_EQ(server1->getStatus(), MultiCropServer::Status::Cancelled);
+
+    // The second job keeps receiving frames from the shared decode and completes
+    while (server2->getStatus() == MultiCropServer::Status::Running) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(server2->getStatus(), MultiCropServer::Status::Completed);
+    ASSERT_GT(server2->getDecodeStatistics().m_sharedFrames, 0);
+
+    for (const auto& i : m_cropOps) {
+        ASSERT_EQ(std::ifstream(i.m_fileName).is_open(), false);
+    }
+    for (const auto& i : cropOps2) {
+        auto stream = Ffr::Stream::getStream(i.m_fileName);
+        ASSERT_NE(stream, nullptr);
+
+        ASSERT_EQ(stream->getWidth(), i.m_resolution.m_width);
+        ASSERT_EQ(stream->getHeight(), i.m_resolution.m_height);
+        ASSERT_EQ(stream->getTotalFrames(), i.m_cropList.size());
+    }
+}
+
+TEST_P(EncodeTest1, encodeStreamAsyncTimeout)
+{
+    // Use different output name for this test
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "timeout-" + i.m_fileName;
+    }
+
+    auto server = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps);
+    ASSERT_NE(server, nullptr);
+    server->setTimeout(std::chrono::milliseconds(0), true);
+    while (server->getStatus() == MultiCropServer::Status::Running) {
+        std::this_thread::yield();
+    }
+    ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Cancelled);
+
+    // Partial outputs should have been kept and finalised
+    for (const auto& i : m_cropOps) {
+        ASSERT_EQ(std::ifstream(i.m_fileName).is_open(), true);
+    }
+}
+
+TEST_P(EncodeTest1, encodeStreamAsyncShared)
+{
+    // Create a second set of outputs for a job that starts after the first
+    std::vector<CropOptions> cropOps2 = m_cropOps;
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "shared1-" + i.m_fileName;
+    }
+    for (auto& i : cropOps2) {
+        i.m_fileName = "shared2-" + i.m_fileName;
+    }
+
+    auto server1 = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps);
+    ASSERT_NE(server1, nullptr);
+    // Start the second job once the first has made some progress so that it attaches part way through
+    while (server1->getStatus() == MultiCropServer::Status::Running && server1->getProgress() < 0.1f) {
+        std::this_thread::yield();
+    }
+    const float progress1 = server1->getProgress();
+    auto server2 = cropAndEncodeAsync(g_testData[GetParam().m_testDataIndex].m_fileName, cropOps2);
+    ASSERT_NE(server2, nullptr);
+
+    // The first job must keep advancing while the second is still decoding the frames it missed
+    bool advanced = false;
+    while (!advanced && server2->getStatus() == MultiCropServer::Status::Running &&
+        server2->getDecodeStatistics().m_sharedFrames == 0) {
+        advanced =
+            server1->getStatus() != MultiCropServer::Status::Running || server1->getProgress() > progress1 + 0.05f;
+        std::this_thread::yield();
+    }
+    ASSERT_TRUE(advanced);
+
+    // Wait for both encodes to finish
+    for (const auto& server : {server1, server2}) {
+        while (server->getStatus() == MultiCropServer::Status::Running) {
+            ASSERT_GE(server->getProgress(), 0.0f);
+            ASSERT_LE(server->getProgress(), 1.0f);
+        }
+        ASSERT_EQ(server->getStatus(), MultiCropServer::Status::Completed);
+    }
+
+    // The first job received every frame from the shared decode
+    const auto stats1 = server1->getDecodeStatistics();
+    ASSERT_EQ(stats1.m_ownFrames, 0);
+    ASSERT_GT(stats1.m_sharedFrames, 0);
+
+    // The second job only decoded the frames it missed and received everything after that from the shared decode
+    const auto stats2 = server2->getDecodeStatistics();
+    ASSERT_LT(stats2.m_lastOwnFrame, stats2.m_joinFrame);
+    ASSERT_LE(stats2.m_ownFrames, stats2.m_joinFrame);
+    ASSERT_GT(stats2.m_sharedFrames, 0);
+
+    // Check that we can open encoded file and its parameters are correct
+    for (const auto& ops : {m_cropOps, cropOps2}) {
+        for (const auto& i : ops) {
+            auto stream = Ffr::Stream::getStream(i.m_fileName);
+            ASSERT_NE(stream, nullptr);
+
+            ASSERT_EQ(stream->getWidth(), i.m_resolution.m_width);
+            ASSERT_EQ(stream->getHeight(), i.m_resolution.m_height);
+            ASSERT_EQ(stream->getTotalFrames(), i.m_cropList.size());
+            ASSERT_DOUBLE_EQ(stream->getFrameRate(), g_testData[GetParam().m_testDataIndex].m_frameRate);
+        }
+    }
+}
+
+TEST_P(EncodeTest1, encodeStreamCropTrack)
+{
+    // Round trip the crop options through crop track files
+    std::vector<CropOptions> trackOps;
+    for (const auto& i : m_cropOps) {
+        const auto trackFile = i.m_fileName + ".fmct";
+        ASSERT_TRUE(saveCropTrack(trackFile, i));
+        CropOptions options;
+        ASSERT_TRUE(loadCropTrack(trackFile, options));
+        ASSERT_NE(options.m_cropTrack, nullptr);
+        ASSERT_EQ(options.m_resolution.m_width, i.m_resolution.m_width);
+        ASSERT_EQ(options.m_resolution.m_height, i.m_resolution.m_height);
+        ASSERT_EQ(options.m_skipRegions, i.m_skipRegions);
+        ASSERT_EQ(options.getNumCrops(), i.m_cropList.size());
+        for (uint64_t j = 0; j < i.m_cropList.size(); ++j) {
+            ASSERT_EQ(options.getCrop(j).m_top, i.getCrop(j).m_top);
+            ASSERT_EQ(options.getCrop(j).m_left, i.getCrop(j).m_left);
+        }
+
+        // Saving a crop track over the file that it is mapped from must leave both the mapping and the file valid.
+        // Windows does not allow a mapped file to be replaced in which case the save fails without changing the file
+        saveCropTrack(trackFile, options);
+        CropOptions reloaded;
+        ASSERT_TRUE(loadCropTrack(trackFile, reloaded));
+        ASSERT_EQ(reloaded.getNumCrops(), i.m_cropList.size());
+        for (uint64_t j = 0; j < i.m_cropList.size(); ++j) {
+            ASSERT_EQ(options.getCrop(j).m_top, i.getCrop(j).m_top);
+            ASSERT_EQ(reloaded.getCrop(j).m_top, i.getCrop(j).m_top);
+            ASSERT_EQ(reloaded.getCrop(j).m_left, i.getCrop(j).m_left);
+        }
+        options.m_fileName = "track-" + i.m_fileName;
+        trackOps.emplace_back(options);
+    }
+
+    ASSERT_TRUE(cropAndEncode(g_testData[GetParam().m_testDataIndex].m_fileName, trackOps));
+
+    // Check that we can open encoded file and its parameters are correct
+    for (const auto& i : trackOps) {
+        auto stream = Ffr::Stream::getStream(i.m_fileName);
+        ASSERT_NE(stream, nullptr);
+
+        ASSERT_EQ(stream->getWidth(), i.m_resolution.m_width);
+        ASSERT_EQ(stream->getHeight(), i.m_resolution.m_height);
+        ASSERT_EQ(stream->getTotalFrames(), i.getNumCrops());
+    }
+}
+
+TEST_P(EncodeTest1, encodeStreamEncoderOptions)
+{
+    // Encode the first output as a fast preview and the rest with the default options
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "options-" + i.m_fileName;
+    }
+    m_cropOps[0].m_overrideEncoderOptions = true;
+    m_cropOps[0].m_encoderOptions.m_preset = EncoderOptions::Preset::Ultrafast;
+    m_cropOps[0].m_encoderOptions.m_quality = 200;
+
+    ASSERT_TRUE(cropAndEncode(g_testData[GetParam().m_testDataIndex].m_fileName, m_cropOps));
+
+    for (const auto& i : m_cropOps) {
+        auto stream = Ffr::Stream::getStream(i.m_fileName);
+        ASSERT_NE(stream, nullptr);
+
+        ASSERT_EQ(stream->getWidth(), i.m_resolution.m_width);
+        ASSERT_EQ(stream->getHeight(), i.m_resolution.m_height);
+        ASSERT_EQ(stream->getTotalFrames(), i.m_cropList.size());
+    }
+}
+
+TEST_P(EncodeTest1, encodeStreamEncoderOptionsApplied)
+{
+    // Encode the same crops twice with only the second output overriding the quality
+    std::vector<CropOptions> cropOps = {m_cropOps[0], m_cropOps[0]};
+    cropOps[0].m_fileName = "options-default-" + m_cropOps[0].m_fileName;
+    cropOps[1].m_fileName = "options-override-" + m_cropOps[0].m_fileName;
+    cropOps[1].m_overrideEncoderOptions = true;
+    cropOps[1].m_encoderOptions.m_quality = 10;
+
+    ASSERT_TRUE(cropAndEncode(g_testData[GetParam().m_testDataIndex].m_fileName, cropOps));
+
+    // The lower quality override must produce a smaller file than the identical default quality output
+    std::vector<std::streamoff> fileSizes;
+    for (const auto& i : cropOps) {
+        auto stream = Ffr::Stream::getStream(i.m_fileName);
+        ASSERT_NE(stream, nullptr);
+        ASSERT_EQ(stream->getTotalFrames(), i.getNumCrops());
+
+        std::ifstream file(i.m_fileName, std::ios::binary | std::ios::ate);
+        ASSERT_TRUE(file.is_open());
+        fileSizes.push_back(file.tellg());
+    }
+    ASSERT_LT(fileSizes[1], fileSizes[0]);
+}
+
+TEST_P(EncodeTest1, encodeStreamIndexed)
+{
+    // Use different output name for this test
+    for (auto& i : m_cropOps) {
+        i.m_fileName = "indexed-" + i.m_fileName;
+    }
+    const auto& sourceFile = g_testData[GetParam().m_testDataIndex].m_fileName;
+    const auto indexFile = SourceIndex::getIndexFile(sourceFile);
+    remove(indexFile.c_str());
+
+    // The index is only created by a decode that starts at the beginning of the source, so first run without skip
+    // regions. The second encode then uses the index to validate and to seek past the skip regions
+    setSourceIndexCache(true);
+    std::vector<CropOptions> firstOps = m_cropOps;
+    for (auto& i : firstOps) {
+        i.m_skipRegions.clear();
+    }
+    for (const auto& cropOps : {firstOps, m_cropOps}) {
+        ASSERT_TRUE(cropAndEncode(sourceFile, cropOps));
+
+        // Check the index was created by the first decode
+        const auto index = SourceIndex::loadSourceIndex(sourceFile);
+        ASSERT_NE(index, nullptr);
+        ASSERT_EQ(index->m_width, g_testData[GetParam().m_testDataIndex].m_width);
+        ASSERT_EQ(index->m_height, g_testData[GetParam().m_testDataIndex].m_height);
+        ASSERT_GE(index->m_indexedFrames, static_cast<int64_t>(cropOps[0].m_cropList.size()));
+        if (index->m_complete) {
+            ASSERT_EQ(index->m_indexedFrames, g_testData[GetParam().m_testDataIndex].m_totalFrames);
+        }
+        ASSERT_FALSE(index->m_keyFrames.empty());
+        ASSERT_EQ(index->m_keyFrames[0], 0);
+
+        for (const auto& i : cropOps) {
+            auto stream = Ffr::Stream::getStream(i.m_fileName);
+            ASSERT_NE(stream, nullptr);
+
+            ASSERT_EQ(stream->getWidth(), i.m_resolution.m_width);
+            ASSERT_EQ(stream->getHeight(), i.m_resolution.m_height);
+            ASSERT_EQ(stream->getTotalFrames(), i.m_cropList.size());
+        }
+    }
+}
+
 INSTANTIATE_TEST_SUITE_P(EncodeTestData, EncodeTest1, ::testing::ValuesIn(g_testDataEncode));